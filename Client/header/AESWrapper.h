@@ -2,12 +2,137 @@
 #define CLIENT_AES_WRAPPER_H
 #pragma once
 #include <string>
+#include <modes.h>
+#include <aes.h>
+#include <gcm.h>
 
 #include "protocol.h"
+#include "ThreadPool.h"
 class AESWrapper
 {
 public:
 	static const unsigned int DEFAULT_KEYLENGTH = 16;
+
+    static const unsigned int BLOCK_SIZE = CryptoPP::AES::BLOCKSIZE;
+
+    // Encrypt a stream piece by piece in one of the transfer's cipher modes.
+    // cipher needs room for outputBound(length) bytes, all return how many bytes were written.
+    class StreamEncryptor
+    {
+    public:
+        virtual ~StreamEncryptor() = default;
+
+        virtual size_t start(uint8_t* cipher) = 0;  // what goes ahead of the first cipher text
+        virtual size_t update(const uint8_t* plain, size_t length, uint8_t* cipher) = 0;
+        // the same, a mode that encrypts in parallel awaits its pieces instead of blocking the calling thread
+        virtual boost::asio::awaitable<size_t> updateAsync(const uint8_t* plain, size_t length, uint8_t* cipher) {
+            co_return update(plain, length, cipher);
+        }
+        virtual size_t final(uint8_t* cipher) = 0;
+
+        // the most an update of length bytes, or the final after it, may write
+        virtual size_t outputBound(size_t length) const { return length + BLOCK_SIZE; }
+        // everything written for a plainSize bytes stream
+        virtual uint64_t cipherSize(uint64_t plainSize) const = 0;
+    };
+
+    // CBC with a zero IV, the ciphertext is the same as encrypt() over all of it.
+    // The key is expanded once, and the object can go on to encrypt further messages.
+    class Encryptor : public StreamEncryptor
+    {
+    public:
+        explicit Encryptor(const AESKey& key);
+
+        ~Encryptor() override                            = default;
+        Encryptor(const Encryptor& other)                = delete;
+        Encryptor(Encryptor&& other) noexcept            = delete;
+        Encryptor& operator=(const Encryptor& other)     = delete;
+        Encryptor& operator=(Encryptor&& other) noexcept = delete;
+
+        size_t start(uint8_t*) override { return 0; }
+        size_t update(const uint8_t* plain, size_t length, uint8_t* cipher) override;
+        size_t final(uint8_t* cipher) override;
+        uint64_t cipherSize(uint64_t plainSize) const override { return encryptedSize(plainSize); }
+
+        static size_t encryptedSize(size_t plainSize);
+    private:
+        CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption _cbcEncryption;
+        CryptoPP::byte _partial[BLOCK_SIZE] = { 0 };  // the tail of the input that doesn't fill a block yet
+        size_t _partialLength;
+    };
+
+    // CTR with a random IV, written ahead of the cipher text. Every block's keystream only depends on
+    // its offset, so the pieces of an asynchronous update are encrypted in parallel on the pool.
+    class CtrEncryptor : public StreamEncryptor
+    {
+    public:
+        CtrEncryptor(const AESKey& key, ThreadPool& pool);
+
+        ~CtrEncryptor() override                               = default;
+        CtrEncryptor(const CtrEncryptor& other)                = delete;
+        CtrEncryptor(CtrEncryptor&& other) noexcept            = delete;
+        CtrEncryptor& operator=(const CtrEncryptor& other)     = delete;
+        CtrEncryptor& operator=(CtrEncryptor&& other) noexcept = delete;
+
+        size_t start(uint8_t* cipher) override;
+        size_t update(const uint8_t* plain, size_t length, uint8_t* cipher) override;
+        boost::asio::awaitable<size_t> updateAsync(const uint8_t* plain, size_t length, uint8_t* cipher) override;
+        size_t final(uint8_t*) override { return 0; }
+        uint64_t cipherSize(uint64_t plainSize) const override { return BLOCK_SIZE + plainSize; }
+
+    private:
+        static constexpr size_t PARALLEL_MIN_PIECE = 32 << 10;  // smaller updates aren't worth a task
+
+        void encrypt(uint64_t offset, const uint8_t* plain, size_t length, uint8_t* cipher) const;
+
+        AESKey _key;
+        CryptoPP::byte _iv[BLOCK_SIZE] = { 0 };
+        uint64_t _offset;               // of the next plain text in the stream
+        ThreadPool& _pool;
+    };
+
+    // GCM over packets of the stream, each sealed on its own as nonce, cipher text and tag,
+    // and authenticated along with its packet number. An asynchronous update seals whole packets in parallel
+    // on the pool.
+    class GcmEncryptor : public StreamEncryptor
+    {
+    public:
+        static const unsigned int NONCE_SIZE = 12;
+        static const unsigned int TAG_SIZE = 16;
+        static const unsigned int OVERHEAD = NONCE_SIZE + TAG_SIZE;
+
+        GcmEncryptor(const AESKey& key, ThreadPool& pool, size_t packetSize);
+
+        ~GcmEncryptor() override                               = default;
+        GcmEncryptor(const GcmEncryptor& other)                = delete;
+        GcmEncryptor(GcmEncryptor&& other) noexcept            = delete;
+        GcmEncryptor& operator=(const GcmEncryptor& other)     = delete;
+        GcmEncryptor& operator=(GcmEncryptor&& other) noexcept = delete;
+
+        size_t start(uint8_t*) override { return 0; }
+        size_t update(const uint8_t* plain, size_t length, uint8_t* cipher) override;
+        boost::asio::awaitable<size_t> updateAsync(const uint8_t* plain, size_t length, uint8_t* cipher) override;
+        size_t final(uint8_t* cipher) override;
+        size_t outputBound(size_t length) const override;
+        uint64_t cipherSize(uint64_t plainSize) const override;
+
+    private:
+        static constexpr size_t PARALLEL_MIN_PIECE = 32 << 10;  // smaller updates aren't worth a task
+
+        void seal(CryptoPP::GCM<CryptoPP::AES>::Encryption& gcm, uint64_t packetNumber,
+                  const uint8_t* plain, size_t length, uint8_t* sealed) const;
+        void sealPackets(uint64_t firstPacket, const uint8_t* plain, size_t packets, uint8_t* sealed) const;
+        size_t sealPartial(const uint8_t*& plain, size_t& length, uint8_t* cipher);
+        size_t holdBack(const uint8_t* plain, size_t length, size_t packets);
+
+        AESKey _key;
+        size_t _packetSize;             // sealed, all but the last packet
+        size_t _plainSize;              // carried by a packet
+        CryptoPP::byte _salt[NONCE_SIZE - sizeof(uint64_t)] = { 0 };  // nonce = salt, packet number
+        uint64_t _packetNumber;         // of the next packet to seal
+        std::vector<uint8_t> _partial;  // plain text that doesn't fill a packet yet
+        ThreadPool& _pool;
+    };
 private:
 	AESKey _key{};
 public:
@@ -25,6 +150,9 @@ public:
     std::string encrypt(const std::string& plain) const;
     std::string encrypt(const uint8_t* plain, size_t length) const;
     std::string decrypt(const uint8_t* cipher, size_t length) const;
+
+    // HKDF-SHA256 of a secret into an AES key, for the given use
+    static AESKey deriveKey(const AESKey& secret, const uint8_t* salt, size_t saltLength, const std::string& info);
 };
 
 #endif //CLIENT_AES_WRAPPER_H
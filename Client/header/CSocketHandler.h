@@ -5,21 +5,42 @@
 #ifndef CLIENT_CSOCKETHANDLER_H
 #define CLIENT_CSOCKETHANDLER_H
 #pragma once
+#include <array>
 #include <string>
 #include <cstdint>
 #include <ostream>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 #include "protocol.h"
-#include <arpa/inet.h>  // for htonl
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/use_future.hpp>
 
 using boost::asio::ip::tcp;
 using boost::asio::io_context;
 
+// A request as it goes on the wire: its serialized fields, then its content sent from where it lies
+struct SFrame
+{
+    std::span<const uint8_t> head;
+    std::span<const uint8_t> body;
+
+    SFrame(std::span<const uint8_t> head, std::span<const uint8_t> body) : head(head), body(body) {}
+    SFrame(const std::vector<uint8_t> &request) : head(request) {}  // a request serialized whole
+    size_t size() const { return head.size() + body.size(); }
+};
+
 class CSocketHandler
 {
 public:
     CSocketHandler();
+    explicit CSocketHandler(io_context &context);  // shares an engine's context, its threads run the coroutines
 
     // Rule of five
     virtual ~CSocketHandler();
@@ -28,32 +49,85 @@ public:
     CSocketHandler& operator=(const CSocketHandler& other)     = delete;
     CSocketHandler& operator=(CSocketHandler&& other) noexcept = delete;
 
+    // another connection to the same server, a file is striped over several
+    std::unique_ptr<CSocketHandler> sibling() const;
+
     // validators
     static bool isValidAddress(const std::string& address);
     static bool isValidPort(const std::string& port);
 
-    // setter
+    // setters
     bool setSocketInfo(const std::string& address, const std::string& port);
+    void setSessionMode(bool keepAlive) { _sessionMode = keepAlive; }
+    void setExactFraming(bool exact) { _exactFraming = exact; }
+
+    // inline getters
+    bool isSessionMode() const { return _sessionMode && !_perRequest; }
 
-    // communicator
-    bool communicate(const std::vector<uint8_t> &toSend, std::vector<uint8_t> &response, csize_t receiveSize);
+    // communicator, coroutines on the handler's io_context.
+    // Frames are taken by value, they only view their bytes. An awaited result is kept in a local before it's
+    // tested, GCC 12 miscompiles a co_await within a condition.
+    boost::asio::awaitable<bool> communicateAsync(SFrame toSend, std::span<uint8_t> response);
+
+    // pipelined requests over the session connection
+    boost::asio::awaitable<bool> openSessionAsync();
+    boost::asio::awaitable<bool> sendAsync(SFrame toSend);
+    boost::asio::awaitable<bool> receiveAsync(std::span<uint8_t> response);
+    void close();
+
+    // synchronous facade, each call runs its coroutine to the end
+    bool communicate(const SFrame &toSend, std::span<uint8_t> response) { return run(communicateAsync(toSend, response)); }
+    bool openSession() { return run(openSessionAsync()); }
+    bool send(const SFrame &toSend) { return run(sendAsync(toSend)); }
+    bool receive(std::span<uint8_t> response) { return run(receiveAsync(response)); }
+    template <typename T>
+    T run(boost::asio::awaitable<T> operation);
 
 
 private:
     std::string    _address;
     std::string    _port;
     io_context*    _ioContext;
+    bool           _ownsContext;  // a private context is run by the facade's caller, a shared one by its engine.
     tcp::resolver* _resolver;
     tcp::socket*   _socket;
-    bool           _bigEndian;
+    tcp::resolver::results_type _endpoints;  // resolved once per address:port.
     bool           _connected;  // indicates that socket has been open and connected.
+    bool           _sessionMode; // keep one connection open across requests.
+    bool           _perRequest;  // server closes after each reply, fall back to a connection per request.
+    bool           _exactFraming; // frames aren't padded to PACKET_SIZE, their header tells their size.
+    std::array<uint8_t, PACKET_SIZE> _discard;  // the padding, and the bytes past what the caller's storage holds, are read into it.
 
     // private methods
-    static void convertEndianess(uint8_t* buffer, size_t size) ;
-    bool receiveData(std::vector<uint8_t> &buffer, csize_t bytesToReceive);
-    bool sendData(const std::vector<uint8_t> &buffer);
-    bool connect();
-    void close();
+    boost::asio::awaitable<bool> receiveData(std::span<uint8_t> response);
+    boost::asio::awaitable<bool> receiveFrame(std::span<uint8_t> response);
+    boost::asio::awaitable<bool> sendData(SFrame frame);
+    boost::asio::awaitable<bool> connectAsync();
+    bool isPeerClosed();
+    boost::asio::awaitable<bool> exchangeAsync(SFrame toSend, std::span<uint8_t> response);
 
 };
+
+/**
+ * Run a coroutine of the handler to its end and return its result.
+ * A private context is run on the calling thread until the coroutine is done. A shared one is run by its
+ * engine's threads, the caller waits for them and so must not be one of them.
+ */
+template <typename T>
+T CSocketHandler::run(boost::asio::awaitable<T> operation) {
+    if (!_ownsContext)
+        return boost::asio::co_spawn(*_ioContext, std::move(operation), boost::asio::use_future).get();
+
+    std::optional<T> result;
+    std::exception_ptr error;
+    boost::asio::co_spawn(*_ioContext, std::move(operation), [&](std::exception_ptr e, T value) {
+        error = e;
+        result = std::move(value);
+    });
+    _ioContext->restart();
+    _ioContext->run();
+    if (error)
+        std::rethrow_exception(error);
+    return std::move(*result);
+}
 #endif //CLIENT_CSOCKETHANDLER_H
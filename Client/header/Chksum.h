@@ -16,14 +16,49 @@
 #include <filesystem>
 #include <string>
 #include <cstdint>
+#include <algorithm>
+#include <span>
+#include <string_view>
 #include "protocol.h"
+#include "ThreadPool.h"
 
 
 class Chksum {
 public:
+    // incremental crc, fed chunk by chunk while a file is read or sent
+    Chksum() : _state(0), _length(0) {}
+    void update(std::span<const uint8_t> data);
+    void update(std::string_view data);
+    CRC finalize(uint64_t totalLength) const;
+    CRC finalize() const { return finalize(_length); }
+    uint64_t size() const { return _length; }
+    void reset() { _state = 0; _length = 0; }
+    void combine(const Chksum &next);
+
+    // a block's checksum computed on the pool, combined in order once awaited. The block must outlive it.
+    static ThreadPool::Pending<Chksum> start(std::span<const uint8_t> block, ThreadPool &pool = ThreadPool::shared());
+
     static bool readFile(std::string &fName, std::string &fContent, CRC &crc, csize_t fileSize);
-private:
     static CRC memcrc(const char * b, size_t n);
+    static CRC memcrcReference(const char * b, size_t n);
+private:
+    uint_fast32_t _state;   // crc register over the bytes fed so far, before the length trailer
+    uint64_t      _length;  // bytes fed so far
+
+    typedef uint_fast32_t (*UpdateKernel)(uint_fast32_t s, const unsigned char * b, size_t n);
+
+    static UpdateKernel selectKernel();
+    static uint_fast32_t update(uint_fast32_t s, const unsigned char * b, size_t n);
+    static uint_fast32_t updateBytewise(uint_fast32_t s, const unsigned char * b, size_t n);
+    static uint_fast32_t updateSlice8(uint_fast32_t s, const unsigned char * b, size_t n);
+    static CRC finish(uint_fast32_t s, uint64_t n);
+
+    static uint_fast32_t multiplyModPoly(uint_fast32_t a, uint_fast32_t b);
+    static uint_fast32_t shiftBytes(uint_fast32_t s, uint64_t n);
+
+    // carry-less multiply folding, PCLMULQDQ on x86-64 and PMULL on AArch64 (CksumClmul.cpp)
+    static bool hasFoldingSupport();
+    static uint_fast32_t updateFolded(uint_fast32_t s, const unsigned char * b, size_t n);
 };
 
 #endif //CLIENT_CHKSUM_H
@@ -10,7 +10,11 @@
 
 class ClientHandle {
 public:
-    ClientHandle() : _isRegistered(false), _currRetry(FIRST_TRY) {}
+    ClientHandle() : _isRegistered(false), _isStopped(false), _currRetry(FIRST_TRY) {}
+    // a session run on the engine of context, with the info files of directory, the working directory when empty
+    explicit ClientHandle(io_context &context, const std::string &directory = {}) :
+        _clientLogic(context, directory), _isRegistered(false), _isStopped(false), _currRetry(FIRST_TRY),
+        _prefix(directory.empty() ? "" : "[" + directory + "] ") {}
 
     // Rule of five
     virtual ~ClientHandle() = default;
@@ -19,28 +23,49 @@ public:
     ClientHandle& operator=(const ClientHandle& other) = delete;
     ClientHandle& operator=(ClientHandle&& other) noexcept = delete;
 
-    // protocol operations
-    bool initializeAndConnect(bool &isReconnect);
-    bool exchangeKeys();
-    bool sendFile(bool &isInvalidCRC);
-    bool sendValidCRC();
-    bool sendInvalidCRC();
-    bool sendAbort();
+    // protocol operations, coroutines on the client logic's io_context
+    boost::asio::awaitable<bool> initializeAndConnectAsync(bool &isReconnect);
+    boost::asio::awaitable<bool> exchangeKeysAsync();
+    boost::asio::awaitable<bool> sendFileAsync(bool &isInvalidCRC);
+    boost::asio::awaitable<bool> sendCRCAsync(ERequestCode code, const std::string &errorContext);
+
+    // a whole session, from connecting to the file's CRC settled, each step retried. An engine runs many at once.
+    boost::asio::awaitable<bool> transferAsync();
+
+    // synchronous facade, each call runs its coroutine to the end
+    bool initializeAndConnect(bool &isReconnect) { return _clientLogic.run(initializeAndConnectAsync(isReconnect)); }
+    bool exchangeKeys() { return _clientLogic.run(exchangeKeysAsync()); }
+    bool sendFile(bool &isInvalidCRC) { return _clientLogic.run(sendFileAsync(isInvalidCRC)); }
+    bool sendValidCRC() { return _clientLogic.run(sendCRCAsync(CRC_VALID, "Sending Valid CRC failed")); }
+    // Its isn't mentioned in the protocol,
+    // but I assume that in this case the server would respond with code 1604 for a success
+    bool sendInvalidCRC() {
+        return _clientLogic.run(sendCRCAsync(CRC_INVALID_SENDING_AGAIN, "Sending Invalid CRC failed"));
+    }
+    bool sendAbort() { return _clientLogic.run(sendCRCAsync(CRC_INVALID_FORTH_TIME_IM_DONE, "Sending abort message failed")); }
+    bool transfer() { return _clientLogic.run(transferAsync()); }
 
     // inline getters and setters
-    bool hasRemainingAttempts() const { return _currRetry <= MAX_RETRIES; }
+    bool hasRemainingAttempts() const { return !_isStopped && _currRetry <= MAX_RETRIES; }
     std::string getErrorMessage() const { return _errMessage; }
     csize_t getAttemptNumber() const { return _currRetry; }
     void resetTries(){ _currRetry = FIRST_TRY;};
+    bool isFileAuthenticated() const { return _clientLogic.isFileAuthenticated(); }
+    bool isKeyExchanged() const { return _clientLogic.isKeyExchanged(); }
 
 
 private:
     ClientLogic                    _clientLogic;
     bool                           _isRegistered; // to check if is registered to not exchange keys in that event
+    bool                           _isStopped;    // a retry wouldn't help, the client's info can't be read
     csize_t                        _currRetry;
     std::string                    _errMessage;
+    std::string                    _prefix;       // of the session's output, sessions of an engine print at once
 
     bool reportErrorAndDecrementRetries(const std::string& errorContext);
+    bool reportErrorAndStop(const std::string& errorContext);
+    bool reportFatalError(const std::string& failedAttempts) const;
+    void report(const std::string& message) const;
 
 };
 #endif //CLIENT_CLIENTHANDLE_H
@@ -6,19 +6,35 @@
 #define CLIENT_CLIENTLOGIC_H
 
 #include "protocol.h"
+#include "ProtocolSchema.h"
 #include "FileHandle.h"
 #include "CSocketHandler.h"
 #include "RSAWrapper.h"
+#include "X25519Wrapper.h"
 #include "Base64Wrapper.h"
 #include "Chksum.h"
 #include "AESWrapper.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <boost/asio/steady_timer.hpp>
 
-constexpr auto KEY_INFO = "priv.key";   // Should be created near the exe file's location.
-constexpr auto CLIENT_INFO = "me.info";   // Should be created near the exe file's location.
-constexpr auto SERVER_INFO = "transfer.info";  // Should be located near the exe file.
+constexpr auto KEY_INFO = "priv.key";   // Created in the session's directory.
+constexpr auto CLIENT_INFO = "me.info";   // Created in the session's directory.
+constexpr auto SERVER_INFO = "transfer.info";  // Should be located in the session's directory.
+constexpr auto TICKET_INFO = "ticket.info";   // Cached near me.info, to resume the session on the next run.
+constexpr auto RESUMPTION_INFO = "file transfer resumption";        // HKDF info of a ticket's secret
+constexpr auto RESUMED_KEY_INFO = "file transfer resumed aes key";  // HKDF info of a resumed session's key
+constexpr auto TRANSFER_KEY_INFO = "file transfer content key";     // HKDF info of an open transfer's key
+constexpr size_t READ_SIZE = 1 << 20;  // File content checksummed and encrypted at a time when sending.
+constexpr size_t DIRECT_IO_MIN_SIZE = 64 << 20;  // Network files this large are read around the page cache.
+constexpr size_t MAX_STREAMS = 8;  // Connections a file may be striped over.
+constexpr auto STRIPE_PROBE_INTERVAL = std::chrono::milliseconds(250);  // The throughput is measured over it.
+constexpr double STRIPE_MIN_GAIN = 1.1;  // A connection added must raise the throughput this much to be kept.
 
 class ClientLogic
 {
@@ -29,13 +45,32 @@ public:
         Uuid                         id;
         ClientName                   userName = {};
         FileName                     fileName = {};
-        DecryptedContentSize         fileSize;
+        LargeContentSize             fileSize;
         std::string                  privateKey = {};
         AESKey                       aesKey = {};
         bool                         _registered = false;
+        bool                         _keyExchanged = false;  // registered together with the key exchange
+    };
+
+    struct SServer
+    {
+        version_t                    version = LEGACY_VERSION;
+        window_t                     windowSize = 1;  // stop-and-wait unless the server advertises a window.
+        cipher_mode_t                cipherMode = CIPHER_CBC;
+        csize_t                      frameSize = PACKET_SIZE;  // of requests, file packets fill it
+    };
+
+    struct SResumption
+    {
+        SessionTicket                ticket = {};
+        AESKey                       secret = {};  // the resumed session's key is derived from it
+        uint64_t                     expiry = 0;   // seconds since the epoch, 0 when there's no ticket
     };
 
     ClientLogic();
+    // a session of an engine, its coroutines run on the engine's threads. Its info files, and the file it sends
+    // unless that's an absolute path, are in its own directory, the working directory when it's empty.
+    explicit ClientLogic(io_context &context, std::string directory = {});
 
     // Rule of five
     virtual ~ClientLogic() = default;
@@ -44,33 +79,123 @@ public:
     ClientLogic& operator=(const ClientLogic& other) = delete;
     ClientLogic& operator=(ClientLogic&& other) noexcept = delete;
 
-    // protocol operations
-    void initialize(bool &isReconnect);
-    bool registerClient();
-    bool sendPublicKey();
-    bool reconnectClient();
-    bool sendEncryptedFileAndCorrespondedCRC(bool &isInvalidCRC);
-    bool sendCRCMessage(const ERequestCode code);
+    // protocol operations, coroutines on the socket handler's io_context
+    bool initialize(bool &isReconnect);
+    boost::asio::awaitable<bool> requestCapabilitiesAsync();
+    boost::asio::awaitable<bool> registerClientAsync();
+    boost::asio::awaitable<bool> sendPublicKeyAsync();
+    boost::asio::awaitable<bool> reconnectClientAsync();
+    boost::asio::awaitable<bool> resumeSessionAsync();
+    boost::asio::awaitable<bool> requestTicketAsync();
+    boost::asio::awaitable<bool> sendEncryptedFileAndCorrespondedCRCAsync(bool &isInvalidCRC);
+    boost::asio::awaitable<bool> sendCRCMessageAsync(ERequestCode code);
+
+    // synchronous facade, each call runs its coroutine to the end
+    bool requestCapabilities() { return _socketHandler->run(requestCapabilitiesAsync()); }
+    bool registerClient() { return _socketHandler->run(registerClientAsync()); }
+    bool sendPublicKey() { return _socketHandler->run(sendPublicKeyAsync()); }
+    bool reconnectClient() { return _socketHandler->run(reconnectClientAsync()); }
+    bool resumeSession() { return _socketHandler->run(resumeSessionAsync()); }
+    bool requestTicket() { return _socketHandler->run(requestTicketAsync()); }
+    bool sendEncryptedFileAndCorrespondedCRC(bool &isInvalidCRC) {
+        return _socketHandler->run(sendEncryptedFileAndCorrespondedCRCAsync(isInvalidCRC));
+    }
+    bool sendCRCMessage(const ERequestCode code) { return _socketHandler->run(sendCRCMessageAsync(code)); }
+    template <typename T>
+    T run(boost::asio::awaitable<T> operation) { return _socketHandler->run(std::move(operation)); }
 
     // inline getters
     std::string getLastError() const { return _lastError.str(); }
     bool isRegistered() const{ return _self._registered;};
+    bool isKeyExchanged() const { return _self._keyExchanged; }
+    bool isFileAuthenticated() const { return _server.cipherMode == CIPHER_GCM; }
 
 private:
+    // encrypted content waiting to be framed into packets, allocated once per file
+    struct SCipherBuffer
+    {
+        std::vector<uint8_t>         buffer;
+        size_t                       start = 0;
+        size_t                       end = 0;
+
+        explicit SCipherBuffer(size_t capacity) : buffer(capacity) {}
+        size_t size() const { return end - start; }
+        const uint8_t* data() const { return buffer.data() + start; }
+        void consume(size_t length) { start += length; }
+        uint8_t* reserve(size_t length);
+        void commit(size_t length) { end += length; }
+    };
+
+    // a file striped over several connections, the state their coroutines share on a strand
+    struct SStriping
+    {
+        typedef LargeMessageNum PacketNumber;
+        // serializes a packet, in order
+        typedef std::function<boost::asio::awaitable<bool>(PacketNumber, std::vector<uint8_t>&)> Produce;
+
+        Produce                               produce;
+        PacketNumber                          totalPackets;
+        PacketNumber                          nextPacket = 1;   // the next packet to produce
+        window_t                              window;           // packets in flight, shared by the connections
+        size_t                                streams = 1;      // connections taking packets, the others drain
+        size_t                                running = 0;      // connections still sending or draining
+        bool                                  producing = false; // a connection awaits the next packet's encryption
+        std::map<PacketNumber, std::vector<uint8_t>> unacknowledged;  // frames sent, kept until acknowledged
+        std::deque<PacketNumber>              orphans;          // in flight over a failed connection, sent again
+        std::map<PacketNumber, csize_t>       rejections;
+        uint64_t                              acknowledged = 0; // bytes, the throughput is measured with
+        bool                                  completed = false;
+        bool                                  failed = false;
+        SResponseReceivedValidLargeFile       response;
+        boost::asio::steady_timer             wakeup;           // cancelled once no connection is running
+        boost::asio::steady_timer             idle;             // waited on by connections with nothing to send
+
+        SStriping(const boost::asio::any_io_executor &executor, Produce produce, PacketNumber totalPackets,
+                  window_t window) :
+                  produce(std::move(produce)), totalPackets(totalPackets), window(window), wakeup(executor),
+                  idle(executor, boost::asio::steady_timer::time_point::max()) {}
+        bool finished() const { return failed || (unacknowledged.empty() && nextPacket > totalPackets); }
+    };
+
+    std::string                           _directory;   // of the session's info files
     SClient                               _self;
+    SServer                               _server;
+    SResumption                           _resumption;
     std::stringstream                     _lastError;
     std::unique_ptr<FileHandle>           _fileHandle;
     std::unique_ptr<CSocketHandler>       _socketHandler;
-    RSAPrivateWrapper                     _rsaPrivateWrapper;
+    std::unique_ptr<RSAPrivateWrapper>    _rsaPrivateWrapper;   // generated only by clients that register
+    ThreadPool::Pending<std::unique_ptr<RSAPrivateWrapper>> _pendingRsaKey;
 
     // private methods
     bool parseInfo();
+    std::string inDirectory(const std::string &filePath) const;
+    void startKeyGeneration();
+    boost::asio::awaitable<bool> registerWithAgreementKey(bool &isUnsupported);
+    boost::asio::awaitable<bool> sendAgreementKey();
+    bool deriveAgreedKey(const SResponseAgreedKey &response, const X25519Wrapper &agreementKey);
+    boost::asio::awaitable<void> generateRsaKey();
     void closeFile();
     void clearLastError();
     bool storeClientInfo();
+    void loadTicket();
+    bool storeTicket(const SResponseSessionTicket &response);
     bool validateHeader(const SResponseHeader &header, EResponseCode expectedCode);
+    template <typename Request, typename Ack, typename Response>
+    boost::asio::awaitable<bool> sendFile(bool &isInvalidCRC);
+    boost::asio::awaitable<bool> sendStriped(SStriping::Produce produce, SStriping::PacketNumber totalPackets,
+                                             SResponseReceivedValidLargeFile &response);
+    boost::asio::awaitable<void> sendStripe(SStriping &striping, CSocketHandler &socket, size_t index);
+    boost::asio::awaitable<bool> transmitPacket(SFrame packet, bool pipelined, std::span<uint8_t> responseData);
+    boost::asio::awaitable<bool> openTransfer(LargeContentSize encryptedSize, LargeMessageNum totalPackets,
+                                              cipher_mode_t cipherMode, csize_t frameSize, const KeySalt &salt,
+                                              transfer_id_t &transferId);
+    template <typename Request, typename Ack, typename Response>
+    bool validatePacketResponse(std::span<const uint8_t> responseData, typename Request::PacketNumber packetNumber,
+                                bool completes, Response &response, bool &rejected);
+    boost::asio::awaitable<bool> encryptFileUntil(FileHandle &file, AESWrapper::StreamEncryptor &encryptor,
+                                                  Chksum &chksum, SCipherBuffer &pending, size_t needed);
     bool isFileEmptyAndOpen(const std::string &filePath);
-    void clientStop() const;
 };
 
 #endif //CLIENT_CLIENTLOGIC_H
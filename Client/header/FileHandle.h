@@ -7,6 +7,9 @@
 #pragma once
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <span>
+#include <vector>
 #include "protocol.h"
 #include <boost/filesystem.hpp>  // for create_directories
 
@@ -27,9 +30,22 @@ public:
     bool open(const std::string& filepath, bool write = false);
     void close();
     size_t size();
+    static bool remove(const std::string& filepath);
 
     bool readLine(std::string& line);
     bool readChunk(std::string &chunk, csize_t chunkSize, bool &eof);
+    bool read(char* buffer, size_t length, size_t &bytesRead);
+
+    // read-only memory mapping, read straight from the page cache without copying
+    bool openMapped(const std::string& filepath);
+    bool isMapped() const { return _mapping != nullptr; }
+    bool readSpan(size_t length, std::span<const uint8_t> &data);
+    bool wasTruncated() const;
+
+    // a background thread reads ahead into a pool of buffers, for files that shouldn't be mapped
+    bool openReadAhead(const std::string& filepath, bool direct = false);
+    bool isReadAhead() const { return _readAhead != nullptr; }
+    static bool isNetworkFileSystem(const std::string& filepath);
 
     bool write(const std::string& data);
     bool write(const ClientName& clientName);
@@ -44,6 +60,21 @@ private:
     std::ofstream _outStream;
     bool _isOpen;
     bool _isWriteMode;
+
+    // mapped and read-ahead modes
+    static constexpr size_t MAPPING_WINDOW = 8 << 20;   // read ahead, and released behind the reader, in these steps
+    void advanceMapping();
+    struct ReadAhead;
+    struct MappedRange;
+    int            _fd;
+    size_t         _fileSize;
+    const uint8_t* _mapping;
+    MappedRange*   _range;      // where a page of the mapping past a truncated file's end reads as zeros
+    std::unique_ptr<ReadAhead> _readAhead;
+    size_t         _position;   // next byte readSpan returns
+    size_t         _released;   // pages before this offset were dropped
+    size_t         _advised;    // pages before this offset were asked to be read ahead
+    std::vector<uint8_t> _spanBuffer;   // readSpan's buffer when the file is read through the stream
 };
 
 #endif //CLIENT_FILE_HANDLE_H
@@ -0,0 +1,244 @@
+//
+// Compile-time description of the wire structs of protocol.h.
+// Each struct names its numeric fields by offset and width. The serializers copy a struct as it is and swap
+// only those fields to little endian, so on little endian hosts they're a plain memcpy.
+//
+
+#ifndef CLIENT_PROTOCOLSCHEMA_H
+#define CLIENT_PROTOCOLSCHEMA_H
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "protocol.h"
+
+// A numeric member of a wire struct, nested members included (payload.packets.packetNumber)
+#define SCHEMA_FIELD(T, MEMBER) Schema::Field{offsetof(T, MEMBER), sizeof(std::declval<T&>().MEMBER)}
+
+// The numeric fields of a wire struct: those of its header, then the given payload fields
+#define SCHEMA_LAYOUT(T, ...) \
+template <> struct Layout<T> { static constexpr auto fields = withHeader<T>(__VA_ARGS__); };
+
+// A response's payload up to a member, for the layouts of older versions that end before it
+#define SCHEMA_PAYLOAD_UNTIL(T, MEMBER) (csize_t)(offsetof(T, MEMBER) - sizeof(SResponseHeader))
+
+namespace Schema
+{
+    constexpr bool SWAP_FIELDS = std::endian::native == std::endian::big;
+
+    // Where a numeric field sits in its struct, it's little endian on the wire
+    struct Field
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    /**
+     * The numeric fields of a wire struct, specialized for every struct of protocol.h.
+     * Everything else (ids, names, keys, content) is a byte array and travels as it is.
+     */
+    template <typename T>
+    struct Layout;
+
+    // Every wire struct starts with its header, the header's fields come first
+    template <typename T, typename... Fields>
+    constexpr auto withHeader(const Fields... payload) {
+        constexpr auto header = Layout<std::remove_cv_t<decltype(T::header)>>::fields;
+        std::array<Field, header.size() + sizeof...(Fields)> fields{};
+        std::copy(header.begin(), header.end(), fields.begin());
+        size_t i = header.size();
+        ((fields[i++] = payload), ...);
+        return fields;
+    }
+
+    template <>
+    struct Layout<SRequestHeader>
+    {
+        static constexpr std::array fields = {SCHEMA_FIELD(SRequestHeader, code),
+                                              SCHEMA_FIELD(SRequestHeader, payloadSize)};
+    };
+
+    template <>
+    struct Layout<SResponseHeader>
+    {
+        static constexpr std::array fields = {SCHEMA_FIELD(SResponseHeader, code),
+                                              SCHEMA_FIELD(SResponseHeader, payloadSize)};
+    };
+
+    // requests
+    SCHEMA_LAYOUT(SRequestConnection)
+    SCHEMA_LAYOUT(SRequestSendPublicKey)
+    SCHEMA_LAYOUT(SRequestSendAgreementKey)
+    SCHEMA_LAYOUT(SRequestTicket)
+    SCHEMA_LAYOUT(SRequestResumption)
+    SCHEMA_LAYOUT(SendMessage)
+    SCHEMA_LAYOUT(SRequestCapabilities,
+                  SCHEMA_FIELD(SRequestCapabilities, payload.windowSize),
+                  SCHEMA_FIELD(SRequestCapabilities, payload.frameSize))
+    SCHEMA_LAYOUT(SRequestSendFile,
+                  SCHEMA_FIELD(SRequestSendFile, payload.contentSize),
+                  SCHEMA_FIELD(SRequestSendFile, payload.origFileSize),
+                  SCHEMA_FIELD(SRequestSendFile, payload.packets.packetNumber),
+                  SCHEMA_FIELD(SRequestSendFile, payload.packets.totalPackets))
+    SCHEMA_LAYOUT(SRequestSendLargeFile,
+                  SCHEMA_FIELD(SRequestSendLargeFile, payload.contentSize),
+                  SCHEMA_FIELD(SRequestSendLargeFile, payload.origFileSize),
+                  SCHEMA_FIELD(SRequestSendLargeFile, payload.packets.packetNumber),
+                  SCHEMA_FIELD(SRequestSendLargeFile, payload.packets.totalPackets))
+    SCHEMA_LAYOUT(SRequestSendCipherFile,
+                  SCHEMA_FIELD(SRequestSendCipherFile, payload.contentSize),
+                  SCHEMA_FIELD(SRequestSendCipherFile, payload.origFileSize),
+                  SCHEMA_FIELD(SRequestSendCipherFile, payload.packets.packetNumber),
+                  SCHEMA_FIELD(SRequestSendCipherFile, payload.packets.totalPackets))
+    SCHEMA_LAYOUT(SRequestOpenTransfer,
+                  SCHEMA_FIELD(SRequestOpenTransfer, payload.contentSize),
+                  SCHEMA_FIELD(SRequestOpenTransfer, payload.origFileSize),
+                  SCHEMA_FIELD(SRequestOpenTransfer, payload.totalPackets),
+                  SCHEMA_FIELD(SRequestOpenTransfer, payload.frameSize))
+    SCHEMA_LAYOUT(SRequestSendCompactFile,
+                  SCHEMA_FIELD(SRequestSendCompactFile, payload.transferId),
+                  SCHEMA_FIELD(SRequestSendCompactFile, payload.packets.packetNumber))
+
+    // responses
+    SCHEMA_LAYOUT(SResponseClientID)
+    SCHEMA_LAYOUT(SResponseAESKey)
+    SCHEMA_LAYOUT(SResponseAgreedKey)
+    SCHEMA_LAYOUT(SResponseSessionTicket,
+                  SCHEMA_FIELD(SResponseSessionTicket, payload.lifetime))
+    SCHEMA_LAYOUT(SResponseCapabilities,
+                  SCHEMA_FIELD(SResponseCapabilities, payload.windowSize),
+                  SCHEMA_FIELD(SResponseCapabilities, payload.frameSize))
+    SCHEMA_LAYOUT(SResponseTransferOpened,
+                  SCHEMA_FIELD(SResponseTransferOpened, payload.transferId))
+    SCHEMA_LAYOUT(SResponsePacketReceived,
+                  SCHEMA_FIELD(SResponsePacketReceived, payload.packetNumber))
+    SCHEMA_LAYOUT(SResponseLargePacketReceived,
+                  SCHEMA_FIELD(SResponseLargePacketReceived, payload.packetNumber))
+    SCHEMA_LAYOUT(SResponseReceivedValidFileWithCRC,
+                  SCHEMA_FIELD(SResponseReceivedValidFileWithCRC, payload.contentSize),
+                  SCHEMA_FIELD(SResponseReceivedValidFileWithCRC, payload.cksum))
+    SCHEMA_LAYOUT(SResponseReceivedValidLargeFile,
+                  SCHEMA_FIELD(SResponseReceivedValidLargeFile, payload.contentSize),
+                  SCHEMA_FIELD(SResponseReceivedValidLargeFile, payload.cksum))
+
+    // swap the fields that lie wholly in the first size bytes of a struct's image
+    template <typename T>
+    void swapFields(uint8_t* const image, const size_t size) {
+        for (const Field& field : Layout<T>::fields) {
+            if (field.offset + field.size <= size)
+                std::reverse(image + field.offset, image + field.offset + field.size);
+        }
+    }
+
+    /**
+     * Write the first size bytes of value as they go on the wire.
+     */
+    template <typename T>
+    void toWire(const T& value, uint8_t* const out, const size_t size = sizeof(T)) {
+        static_assert(std::is_trivially_copyable_v<T>, "wire structs are copied byte by byte");
+        std::memcpy(out, &value, size);
+        if constexpr (SWAP_FIELDS)
+            swapFields<T>(out, size);
+    }
+
+    template <typename T>
+    std::vector<uint8_t> serialize(const T& value, const size_t size = sizeof(T)) {
+        std::vector<uint8_t> wire(size);
+        toWire(value, wire.data(), size);
+        return wire;
+    }
+
+    /**
+     * Read value from its wire image, the fields past a shorter image are left as they are.
+     */
+    template <typename T>
+    void deserialize(const std::span<const uint8_t> wire, T& value) {
+        static_assert(std::is_trivially_copyable_v<T>, "wire structs are copied byte by byte");
+        const size_t size = std::min(wire.size(), sizeof(T));
+        std::memcpy(&value, wire.data(), size);
+        if constexpr (SWAP_FIELDS)
+            swapFields<T>(reinterpret_cast<uint8_t*>(&value), size);
+    }
+
+    // The bytes of a struct, to receive its wire image into
+    template <typename T>
+    std::span<uint8_t> image(T& value) {
+        static_assert(std::is_trivially_copyable_v<T>, "wire structs are copied byte by byte");
+        return {reinterpret_cast<uint8_t*>(&value), sizeof(T)};
+    }
+
+    /**
+     * Turn a struct that was received as its wire image into its value, in place.
+     */
+    template <typename T>
+    void fromWire(T& value) {
+        if constexpr (SWAP_FIELDS)
+            swapFields<T>(reinterpret_cast<uint8_t*>(&value), sizeof(T));
+    }
+
+    // The payload size of a response code, for servers of the version that introduced that layout and later
+    struct ResponsePayload
+    {
+        code_t    code;
+        version_t since;
+        csize_t   size;
+    };
+
+    template <typename Response>
+    constexpr csize_t payloadOf = sizeof(Response) - sizeof(SResponseHeader);
+
+    constexpr std::array RESPONSE_PAYLOADS = {
+        ResponsePayload{REGISTRATION_SUCCEEDED,                    DEF_VAL, payloadOf<SResponseClientID>},
+        ResponsePayload{RECEIVED_PUBLIC_KEY_AND_SENDING_AES,       DEF_VAL, payloadOf<SResponseAESKey>},
+        ResponsePayload{APPROVED_REQUEST_TO_RECONNECT_SENDING_AES, DEF_VAL, payloadOf<SResponseAESKey>},
+        ResponsePayload{AGREED_ON_AES_KEY,                         DEF_VAL, payloadOf<SResponseAgreedKey>},
+        ResponsePayload{SESSION_TICKET,                            DEF_VAL, payloadOf<SResponseSessionTicket>},
+        ResponsePayload{TRANSFER_OPENED,                           DEF_VAL, payloadOf<SResponseTransferOpened>},
+        ResponsePayload{APPROVED_GETTING_MESSAGE_THANKS,           DEF_VAL, payloadOf<SResponseClientID>},
+        ResponsePayload{FILE_RECEIVED_PROPERLY_WITH_CRC, DEF_VAL,            payloadOf<SResponseReceivedValidFileWithCRC>},
+        ResponsePayload{FILE_RECEIVED_PROPERLY_WITH_CRC, LARGE_FILE_VERSION, payloadOf<SResponseReceivedValidLargeFile>},
+        ResponsePayload{APPROVED_GETTING_PACKET_THANKS,  DEF_VAL,            payloadOf<SResponsePacketReceived>},
+        ResponsePayload{APPROVED_GETTING_PACKET_THANKS,  LARGE_FILE_VERSION, payloadOf<SResponseLargePacketReceived>},
+        ResponsePayload{PACKET_REJECTED,                 DEF_VAL,            payloadOf<SResponsePacketReceived>},
+        ResponsePayload{PACKET_REJECTED,                 LARGE_FILE_VERSION, payloadOf<SResponseLargePacketReceived>},
+        ResponsePayload{SERVER_CAPABILITIES, DEF_VAL,
+                        SCHEMA_PAYLOAD_UNTIL(SResponseCapabilities, payload.cipherMode)},
+        ResponsePayload{SERVER_CAPABILITIES, CIPHER_MODE_VERSION,
+                        SCHEMA_PAYLOAD_UNTIL(SResponseCapabilities, payload.frameSize)},
+        ResponsePayload{SERVER_CAPABILITIES, FRAME_SIZE_VERSION, payloadOf<SResponseCapabilities>},
+    };
+
+    /**
+     * The payload size of a response code from a server of the given version, the latest layout it knows.
+     * 0 for codes that carry no payload.
+     */
+    constexpr csize_t expectedPayloadSize(const code_t code, const version_t version) {
+        const ResponsePayload* latest = nullptr;
+        for (const ResponsePayload& entry : RESPONSE_PAYLOADS) {
+            if (entry.code == code && entry.since <= version && (latest == nullptr || entry.since > latest->since))
+                latest = &entry;
+        }
+        return latest == nullptr ? 0 : latest->size;
+    }
+
+    // every file packet layout fills a PACKET_SIZE frame
+    static_assert(sizeof(SRequestSendFile) == PACKET_SIZE);
+    static_assert(sizeof(SRequestSendLargeFile) == PACKET_SIZE);
+    static_assert(sizeof(SRequestSendCipherFile) == PACKET_SIZE);
+    static_assert(sizeof(SRequestSendCompactFile) == PACKET_SIZE);
+    static_assert(expectedPayloadSize(SERVER_CAPABILITIES, LEGACY_VERSION) == sizeof(window_t));
+    static_assert(expectedPayloadSize(SERVER_CAPABILITIES, CIPHER_MODE_VERSION) == sizeof(window_t) + sizeof(cipher_mode_t));
+    static_assert(expectedPayloadSize(GENERIC_ERROR, CLIENT_VERSION) == 0);
+}
+
+#undef SCHEMA_FIELD
+#undef SCHEMA_LAYOUT
+#undef SCHEMA_PAYLOAD_UNTIL
+
+#endif //CLIENT_PROTOCOLSCHEMA_H
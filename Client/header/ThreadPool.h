@@ -0,0 +1,157 @@
+//
+// Fixed size pool of worker threads, shared by the cpu heavy parts of the client.
+//
+
+#ifndef CLIENT_THREADPOOL_H
+#define CLIENT_THREADPOOL_H
+#pragma once
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/execution/outstanding_work.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+class ThreadPool
+{
+public:
+    // A task started on the pool, that a coroutine awaits without blocking its thread
+    template <typename T>
+    class Pending
+    {
+    public:
+        bool valid() const { return _state != nullptr; }
+        boost::asio::awaitable<T> get();
+
+    private:
+        friend class ThreadPool;
+        struct Empty {};
+        struct State
+        {
+            std::mutex mutex;
+            bool done = false;
+            std::conditional_t<std::is_void_v<T>, Empty, std::optional<T>> value;
+            std::exception_ptr error;
+            std::function<void()> resume;   // of the coroutine awaiting the task before it's done
+        };
+        std::shared_ptr<State> _state;
+    };
+
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+
+    // Rule of five
+    virtual ~ThreadPool();
+    ThreadPool(const ThreadPool& other)                = delete;
+    ThreadPool(ThreadPool&& other) noexcept            = delete;
+    ThreadPool& operator=(const ThreadPool& other)     = delete;
+    ThreadPool& operator=(ThreadPool&& other) noexcept = delete;
+
+    // process wide pool, one thread per core
+    static ThreadPool& shared();
+
+    size_t size() const { return _workers.size(); }
+
+    /**
+     * Queue a task, its result (or exception) is delivered through the returned future.
+     * A task must not wait on other tasks of the same pool, all workers could end up waiting.
+     */
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& task) {
+        auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(task));
+        std::future<std::invoke_result_t<F>> result = packaged->get_future();
+        enqueue([packaged]() { (*packaged)(); });
+        return result;
+    }
+
+    /**
+     * Queue a task now, its result (or exception) is awaited later through the returned Pending.
+     */
+    template <typename F>
+    Pending<std::invoke_result_t<F>> start(F&& task);
+    boost::asio::awaitable<void> all(std::vector<std::function<void()>> tasks);
+
+private:
+    void enqueue(std::function<void()> task);
+    void work();
+
+    std::vector<std::thread> _workers;
+    std::queue<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stopping;
+};
+
+template <typename F>
+ThreadPool::Pending<std::invoke_result_t<F>> ThreadPool::start(F&& task) {
+    typedef std::invoke_result_t<F> T;
+    auto state = std::make_shared<typename Pending<T>::State>();
+    auto shared = std::make_shared<std::decay_t<F>>(std::forward<F>(task));
+    enqueue([state, shared]() {
+        try {
+            if constexpr (std::is_void_v<T>)
+                (*shared)();
+            else
+                state->value.emplace((*shared)());
+        } catch (...) {
+            state->error = std::current_exception();
+        }
+        std::function<void()> resume;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done = true;
+            resume = std::move(state->resume);
+        }
+        if (resume)
+            resume();
+    });
+
+    Pending<T> pending;
+    pending._state = std::move(state);
+    return pending;
+}
+
+/**
+ * Resume on the awaiting coroutine's executor once the task is done, with its result or rethrowing its failure.
+ * A Pending is awaited once.
+ */
+template <typename T>
+boost::asio::awaitable<T> ThreadPool::Pending<T>::get() {
+    const std::shared_ptr<State> state = std::move(_state);
+    co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&, void()>(
+            [state](auto handler) {
+                // the executor is kept busy meanwhile, a context that runs out of work would return
+                const auto executor = boost::asio::prefer(boost::asio::get_associated_executor(handler),
+                                                          boost::asio::execution::outstanding_work.tracked);
+                auto waiting = std::make_shared<decltype(handler)>(std::move(handler));
+                std::function<void()> resume = [executor, waiting]() {
+                    boost::asio::post(executor, [waiting]() { (*waiting)(); });
+                };
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (!state->done) {
+                        state->resume = std::move(resume);
+                        return;
+                    }
+                }
+                resume();
+            }, boost::asio::use_awaitable);
+
+    if (state->error)
+        std::rethrow_exception(state->error);
+    if constexpr (!std::is_void_v<T>)
+        co_return std::move(*state->value);
+}
+
+#endif //CLIENT_THREADPOOL_H
@@ -0,0 +1,51 @@
+//
+// Runs the sessions' coroutines, their socket I/O and protocol steps, on a handful of threads.
+//
+
+#ifndef CLIENT_TRANSFERENGINE_H
+#define CLIENT_TRANSFERENGINE_H
+#pragma once
+#include <future>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/use_future.hpp>
+
+class TransferEngine
+{
+public:
+    explicit TransferEngine(size_t threads = std::thread::hardware_concurrency());
+
+    // Rule of five
+    virtual ~TransferEngine();
+    TransferEngine(const TransferEngine& other)                = delete;
+    TransferEngine(TransferEngine&& other) noexcept            = delete;
+    TransferEngine& operator=(const TransferEngine& other)     = delete;
+    TransferEngine& operator=(TransferEngine&& other) noexcept = delete;
+
+    // the context a session's ClientLogic is constructed with
+    boost::asio::io_context& context() { return _context; }
+    size_t size() const { return _threads.size(); }
+
+    /**
+     * Start a session coroutine, its result (or exception) is delivered through the returned future.
+     * The future must not be waited on by the engine's own threads.
+     */
+    template <typename T>
+    std::future<T> spawn(boost::asio::awaitable<T> session) {
+        return boost::asio::co_spawn(_context, std::move(session), boost::asio::use_future);
+    }
+
+    void join();
+
+private:
+    boost::asio::io_context _context;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
+    std::vector<std::thread> _threads;
+};
+
+#endif //CLIENT_TRANSFERENGINE_H
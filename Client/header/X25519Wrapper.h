@@ -0,0 +1,40 @@
+#ifndef CLIENT_X25519_WRAPPER_H
+#define CLIENT_X25519_WRAPPER_H
+#pragma once
+
+#include <osrng.h>
+#include <xed25519.h>
+
+#include <string>
+
+#include "protocol.h"
+
+// X25519 key pair, agreeing on the AES key with a peer's public key
+class X25519Wrapper
+{
+public:
+	static const unsigned int KEYSIZE = AGREEMENT_KEY_SIZE;
+
+private:
+	CryptoPP::AutoSeededRandomPool _rng;
+	CryptoPP::x25519 _domain;
+	CryptoPP::byte _privateKey[KEYSIZE] = { 0 };
+	CryptoPP::byte _publicKey[KEYSIZE] = { 0 };
+
+public:
+	X25519Wrapper();
+	explicit X25519Wrapper(const std::string& privateKey);
+
+	virtual ~X25519Wrapper();
+	X25519Wrapper(const X25519Wrapper& other)                = delete;
+	X25519Wrapper(X25519Wrapper&& other) noexcept            = delete;
+	X25519Wrapper& operator=(const X25519Wrapper& other)     = delete;
+	X25519Wrapper& operator=(X25519Wrapper&& other) noexcept = delete;
+
+	std::string getPrivateKey() const;
+	AgreementKey getPublicKey() const;
+
+	AESKey deriveKey(const AgreementKey& peerPublicKey, const KeySalt& salt) const;
+};
+
+#endif //CLIENT_X25519_WRAPPER_H
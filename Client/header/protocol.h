@@ -24,11 +24,28 @@ typedef uint32_t EncryptedContentSize;
 typedef uint32_t DecryptedContentSize;
 typedef uint16_t currentMessageNum;
 typedef uint16_t totalMessageCount;
+typedef uint64_t LargeContentSize;     // content sizes of the large file layout
+typedef uint64_t LargeMessageNum;      // packet numbers and counts of the large file layout
+typedef uint16_t window_t;
+typedef uint8_t  cipher_mode_t;
+typedef uint32_t transfer_id_t;        // names an open file transfer in its compact packets
 typedef uint32_t CRC;
 
 // Constants. All sizes are in BYTES.
 constexpr csize_t    PACKET_SIZE             = 1024;   // Better be the same on the server side.
-constexpr version_t  CLIENT_VERSION          = 3;
+constexpr version_t  CLIENT_VERSION          = 14;
+constexpr version_t  LEGACY_VERSION          = 3;      // Assumed for servers that don't answer CAPABILITIES.
+constexpr version_t  WINDOWED_ACK_VERSION    = 4;      // File packets are acknowledged with their packet number.
+constexpr version_t  LARGE_FILE_VERSION      = 5;      // File packets with 64-bit sizes and packet numbers.
+constexpr version_t  CIPHER_MODE_VERSION     = 6;      // File packets tell their cipher mode, negotiated in CAPABILITIES.
+constexpr version_t  KEY_AGREEMENT_VERSION   = 7;      // The AES key is agreed on with X25519 instead of sent with RSA.
+constexpr version_t  RESUMPTION_VERSION      = 8;      // Reconnections may resume a session with a ticket, skipping the key exchange.
+constexpr version_t  COMBINED_REGISTRATION_VERSION = 9; // New clients register and agree on the AES key in one request.
+constexpr version_t  COMPACT_FILE_VERSION    = 10;     // A file is described once when opened, its packets carry only content.
+constexpr version_t  FRAME_SIZE_VERSION      = 11;     // Requests longer than PACKET_SIZE, up to a frame size negotiated in CAPABILITIES.
+constexpr version_t  EXACT_FRAME_VERSION     = 12;     // Requests and their responses are framed by their header's payload size, unpadded.
+constexpr version_t  STRIPED_VERSION         = 13;     // An open transfer's packets may arrive over several connections, in any order.
+constexpr version_t  TRANSFER_KEY_VERSION    = 14;     // An open transfer's content is encrypted with a key derived for it.
 constexpr csize_t    CLIENT_ID_SIZE          = 16;
 constexpr csize_t    CLIENT_ACTUALNAME_SIZE  = 100;
 constexpr csize_t    CLIENT_NAME_SIZE        = 255;
@@ -36,8 +53,17 @@ constexpr csize_t    FILE_NAME_SIZE          = 255;
 constexpr csize_t    RSA_KEY_SIZE            = RSAPublicWrapper::KEYSIZE; // 160
 constexpr csize_t    DECRYPTED_AES_KEY_SIZE  = 128;
 constexpr csize_t    AES_KEY_SIZE            = 16;
+constexpr csize_t    AGREEMENT_KEY_SIZE      = 32;  // X25519 public and private keys
+constexpr csize_t    KEY_SALT_SIZE           = 16;
+constexpr csize_t    TICKET_SIZE             = 68;  // opaque to the client
+constexpr csize_t    RESUMPTION_NONCE_SIZE   = 16;
 constexpr csize_t    PRIVATE_KEY_SIZE_BASE64 = 856; // the original size was 1024 then changed in CryptoPP and encoded
 constexpr csize_t    CHUNK_SIZE              = 734;  // 1024 - sizeof(RequestSendFile) + messageContent
+constexpr csize_t    LARGE_CHUNK_SIZE        = 714;  // 1024 - sizeof(RequestSendLargeFile) + messageContent
+constexpr csize_t    CIPHER_CHUNK_SIZE       = 713;  // 1024 - sizeof(RequestSendCipherFile) + messageContent
+constexpr csize_t    COMPACT_CHUNK_SIZE      = 989;  // 1024 - sizeof(RequestSendCompactFile) + messageContent
+constexpr window_t   MAX_WINDOW_SIZE         = 32;   // File packets in flight before waiting for an ack.
+constexpr csize_t    MAX_FRAME_SIZE          = 1 << 20;  // The largest request frame the client would send.
 
 #define DEFINE_ARRAY(NAME, SIZE) \
 typedef std::array<uint8_t, SIZE> NAME;
@@ -48,7 +74,14 @@ DEFINE_ARRAY(Uuid, CLIENT_ID_SIZE)
 DEFINE_ARRAY(FileName, FILE_NAME_SIZE)
 DEFINE_ARRAY(DecryptedAESKey, DECRYPTED_AES_KEY_SIZE)
 DEFINE_ARRAY(AESKey, AES_KEY_SIZE)
+DEFINE_ARRAY(AgreementKey, AGREEMENT_KEY_SIZE)
+DEFINE_ARRAY(KeySalt, KEY_SALT_SIZE)
+DEFINE_ARRAY(SessionTicket, TICKET_SIZE)
+DEFINE_ARRAY(ResumptionNonce, RESUMPTION_NONCE_SIZE)
 DEFINE_ARRAY(MessageContent, CHUNK_SIZE)
+DEFINE_ARRAY(LargeMessageContent, LARGE_CHUNK_SIZE)
+DEFINE_ARRAY(CipherMessageContent, CIPHER_CHUNK_SIZE)
+DEFINE_ARRAY(CompactMessageContent, COMPACT_CHUNK_SIZE)
 
 
 enum ERequestCode
@@ -57,6 +90,13 @@ enum ERequestCode
     SENDING_PUBLIC_KEY =             826,
     RECONNECTION =                   827,
     SENDING_FILE =                   828,
+    CAPABILITIES =                   829, // uuid ignored.
+    SENDING_AGREEMENT_KEY =          830, // like 826, with an X25519 public key.
+    REQUEST_TICKET =                 831, // payload is empty.
+    RESUMPTION =                     832, // like 827, with the ticket of a previous session.
+    REGISTRATION_WITH_KEY =          833, // like 830 with the uuid ignored, answered by 1611 or 1601.
+    OPEN_TRANSFER =                  834, // like 828 without content, answered by 1613.
+    SENDING_FILE_DATA =              835, // a packet of an open transfer, answered like 828.
     CRC_VALID =                      900,
     CRC_INVALID_SENDING_AGAIN =      901,
     CRC_INVALID_FORTH_TIME_IM_DONE = 902
@@ -71,9 +111,24 @@ enum EResponseCode
     APPROVED_GETTING_MESSAGE_THANKS             = 1604,
     APPROVED_REQUEST_TO_RECONNECT_SENDING_AES   = 1605, // table identical to code 1602
     REQUEST_FOR_RECONNECTION_DENIED             = 1606, // client's not registered, or invalid public key
-    GENERIC_ERROR                               = 1607  // payload invalid. payloadSize = 0.
+    GENERIC_ERROR                               = 1607, // payload invalid. payloadSize = 0.
+    SERVER_CAPABILITIES                         = 1608,
+    APPROVED_GETTING_PACKET_THANKS              = 1609, // like 1604, with the acknowledged packet number.
+    PACKET_REJECTED                             = 1610, // a CIPHER_GCM packet failed authentication, resend it.
+    AGREED_ON_AES_KEY                           = 1611, // like 1602 and 1605, for clients with an X25519 key.
+    SESSION_TICKET                              = 1612, // a ticket to resume the session with, also approves a resumption.
+    TRANSFER_OPENED                             = 1613  // the id the file's packets are sent with.
 };
 
+// How the file's content is encrypted
+enum ECipherMode
+{
+    CIPHER_CBC = 0,     // zero IV, PKCS#7 padded. The only mode before CIPHER_MODE_VERSION.
+    CIPHER_CTR = 1,     // random IV in the content's first 16 bytes, chunks can be encrypted independently.
+    CIPHER_GCM = 2      // every packet sealed on its own (nonce, cipher text, tag), no CRC exchange afterwards.
+};
+constexpr uint8_t    SUPPORTED_CIPHER_MODES  = (1 << CIPHER_CBC) | (1 << CIPHER_CTR) | (1 << CIPHER_GCM);
+
 #pragma pack(push, 1)
 
 struct SRequestHeader
@@ -96,6 +151,12 @@ struct SRequestHeader
         // store received client's ID
         std::copy_n(id.begin(),CLIENT_ID_SIZE, clientId.begin());
     }
+    // constructor for requests whose layout is told by an older version
+    SRequestHeader(const version_t reqVersion, const Uuid& id, const code_t reqCode) :
+                    version(reqVersion), code(reqCode), payloadSize(DEF_VAL) {
+        // store received client's ID
+        std::copy_n(id.begin(),CLIENT_ID_SIZE, clientId.begin());
+    }
 };
 
 
@@ -156,9 +217,81 @@ struct SResponseAESKey
     }payload;
 };
 
+struct SRequestSendAgreementKey
+{
+    SRequestHeader header;
+    struct
+    {
+        ClientName   clientName = {};
+        AgreementKey clientPublicKey = {};
+    }payload;
+    SRequestSendAgreementKey(const Uuid& id, const ClientName& cName, const AgreementKey& publicKey) :
+                             header(id, SENDING_AGREEMENT_KEY, CLIENT_NAME_SIZE + AGREEMENT_KEY_SIZE) {
+        // store received client's name and key
+        std::copy_n(cName.begin(),CLIENT_NAME_SIZE, payload.clientName.begin());
+        payload.clientPublicKey = publicKey;
+    }
+    // constructor for registering with the key, the uuid is in the reply
+    SRequestSendAgreementKey(const ClientName& cName, const AgreementKey& publicKey) :
+                             header(REGISTRATION_WITH_KEY, CLIENT_NAME_SIZE + AGREEMENT_KEY_SIZE) {
+        std::copy_n(cName.begin(),CLIENT_NAME_SIZE, payload.clientName.begin());
+        payload.clientPublicKey = publicKey;
+    }
+};
+
+// The AES key is derived from the X25519 agreement of the client's key with the server's, and the salt.
+struct SResponseAgreedKey
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid         clientId = {};
+        AgreementKey serverPublicKey = {};
+        KeySalt      salt = {};
+    }payload;
+};
+
+
+struct SRequestTicket
+{
+    SRequestHeader header;
+    explicit SRequestTicket(const Uuid& id) : header(id, REQUEST_TICKET) {}
+};
+
+struct SRequestResumption
+{
+    SRequestHeader header;
+    struct
+    {
+        ClientName      clientName = {};
+        SessionTicket   ticket = {};
+        ResumptionNonce nonce = {};    // salt of the resumed session's key
+    }payload;
+    SRequestResumption(const Uuid& id, const ClientName& cName, const SessionTicket& ticket,
+                       const ResumptionNonce& nonce) : header(id, RESUMPTION, sizeof(payload)) {
+        std::copy_n(cName.begin(),CLIENT_NAME_SIZE, payload.clientName.begin());
+        payload.ticket = ticket;
+        payload.nonce = nonce;
+    }
+};
+
+struct SResponseSessionTicket
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid          clientId = {};
+        uint32_t      lifetime = DEF_VAL;   // seconds the ticket is valid for
+        SessionTicket ticket = {};
+    }payload;
+};
+
 
 struct SRequestSendFile
 {
+    typedef currentMessageNum PacketNumber;
+    static constexpr csize_t  CHUNK = CHUNK_SIZE;
+
     SRequestHeader header;
     struct
     {
@@ -174,7 +307,7 @@ struct SRequestSendFile
     }payload;
     SRequestSendFile(const Uuid &id, const FileName &fName, const DecryptedContentSize originalFileSize,
                      const EncryptedContentSize encryptedFileSize, const totalMessageCount totalPackets) :
-                     header(id, SENDING_FILE){
+                     header(WINDOWED_ACK_VERSION, id, SENDING_FILE){
         payload.origFileSize = originalFileSize;
         payload.contentSize = encryptedFileSize;
         payload.packets.packetNumber = FIRST_TRY;
@@ -193,6 +326,16 @@ struct SRequestSendFile
     }
 };
 
+struct SResponsePacketReceived
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid              clientId = {};
+        currentMessageNum packetNumber = DEF_VAL;
+    }payload;
+};
+
 struct SResponseReceivedValidFileWithCRC
 {
     SResponseHeader header;
@@ -205,6 +348,176 @@ struct SResponseReceivedValidFileWithCRC
     }payload;
 };
 
+// SRequestSendFile and its replies with 64-bit sizes and packet numbers, for servers of LARGE_FILE_VERSION.
+struct SRequestSendLargeFile
+{
+    typedef LargeMessageNum  PacketNumber;
+    static constexpr csize_t CHUNK = LARGE_CHUNK_SIZE;
+
+    SRequestHeader header;
+    struct
+    {
+        LargeContentSize contentSize = DEF_VAL;
+        LargeContentSize origFileSize = DEF_VAL;
+        struct
+        {
+            LargeMessageNum packetNumber = DEF_VAL;
+            LargeMessageNum totalPackets = DEF_VAL;
+        }packets;
+        FileName fileName = {};
+        LargeMessageContent messageContent = {};
+    }payload;
+    SRequestSendLargeFile(const Uuid &id, const FileName &fName, const LargeContentSize originalFileSize,
+                          const LargeContentSize encryptedFileSize, const LargeMessageNum totalPackets) :
+                          header(LARGE_FILE_VERSION, id, SENDING_FILE){
+        payload.origFileSize = originalFileSize;
+        payload.contentSize = encryptedFileSize;
+        payload.packets.packetNumber = FIRST_TRY;
+        payload.packets.totalPackets = totalPackets;
+        // store file name
+        std::copy_n(fName.begin(),FILE_NAME_SIZE, payload.fileName.begin());
+    }
+    csize_t setPayloadSize(csize_t messageSize){
+        csize_t size = 0;
+        size += sizeof(payload.contentSize);
+        size += sizeof(payload.origFileSize);
+        size += sizeof(payload.packets);
+        size += sizeof(payload.fileName);
+        size += messageSize;
+        return (header.payloadSize = size); // assign payload size and return it
+    }
+};
+
+// SRequestSendLargeFile with the transfer's cipher mode, for servers of CIPHER_MODE_VERSION.
+struct SRequestSendCipherFile
+{
+    typedef LargeMessageNum  PacketNumber;
+    static constexpr csize_t CHUNK = CIPHER_CHUNK_SIZE;
+
+    SRequestHeader header;
+    struct
+    {
+        LargeContentSize contentSize = DEF_VAL;
+        LargeContentSize origFileSize = DEF_VAL;
+        struct
+        {
+            LargeMessageNum packetNumber = DEF_VAL;
+            LargeMessageNum totalPackets = DEF_VAL;
+        }packets;
+        cipher_mode_t cipherMode = CIPHER_CBC;
+        FileName fileName = {};
+        CipherMessageContent messageContent = {};
+    }payload;
+    SRequestSendCipherFile(const Uuid &id, const FileName &fName, const LargeContentSize originalFileSize,
+                           const LargeContentSize encryptedFileSize, const LargeMessageNum totalPackets) :
+                           header(CIPHER_MODE_VERSION, id, SENDING_FILE){
+        payload.origFileSize = originalFileSize;
+        payload.contentSize = encryptedFileSize;
+        payload.packets.packetNumber = FIRST_TRY;
+        payload.packets.totalPackets = totalPackets;
+        // store file name
+        std::copy_n(fName.begin(),FILE_NAME_SIZE, payload.fileName.begin());
+    }
+    csize_t setPayloadSize(csize_t messageSize){
+        csize_t size = 0;
+        size += sizeof(payload.contentSize);
+        size += sizeof(payload.origFileSize);
+        size += sizeof(payload.packets);
+        size += sizeof(payload.cipherMode);
+        size += sizeof(payload.fileName);
+        size += messageSize;
+        return (header.payloadSize = size); // assign payload size and return it
+    }
+};
+
+// Describes a file once, for servers of COMPACT_FILE_VERSION. Its packets are sent as SRequestSendCompactFile.
+struct SRequestOpenTransfer
+{
+    SRequestHeader header;
+    struct
+    {
+        LargeContentSize contentSize = DEF_VAL;
+        LargeContentSize origFileSize = DEF_VAL;
+        LargeMessageNum  totalPackets = DEF_VAL;
+        cipher_mode_t    cipherMode = CIPHER_CBC;
+        FileName         fileName = {};
+        csize_t          frameSize = PACKET_SIZE;  // from FRAME_SIZE_VERSION, of every packet but the last
+        KeySalt          salt = {};  // from TRANSFER_KEY_VERSION, the transfer's key is derived with it
+    }payload;
+    SRequestOpenTransfer(const Uuid &id, const FileName &fName, const LargeContentSize originalFileSize,
+                         const LargeContentSize encryptedFileSize, const LargeMessageNum totalPackets,
+                         const cipher_mode_t cipherMode, const csize_t frameSize, const KeySalt &salt) :
+                         header(id, OPEN_TRANSFER, sizeof(payload)) {
+        payload.origFileSize = originalFileSize;
+        payload.contentSize = encryptedFileSize;
+        payload.totalPackets = totalPackets;
+        payload.cipherMode = cipherMode;
+        payload.frameSize = frameSize;
+        payload.salt = salt;
+        // store file name
+        std::copy_n(fName.begin(),FILE_NAME_SIZE, payload.fileName.begin());
+    }
+};
+
+struct SResponseTransferOpened
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid          clientId = {};
+        transfer_id_t transferId = DEF_VAL;
+    }payload;
+};
+
+// A packet of an open transfer, nothing but its number and content.
+// Its content fills the frame size negotiated with servers of FRAME_SIZE_VERSION, CHUNK is that of PACKET_SIZE.
+struct SRequestSendCompactFile
+{
+    typedef LargeMessageNum  PacketNumber;
+    static constexpr csize_t CHUNK = COMPACT_CHUNK_SIZE;
+
+    SRequestHeader header;
+    struct
+    {
+        transfer_id_t transferId = DEF_VAL;
+        struct
+        {
+            LargeMessageNum packetNumber = DEF_VAL;
+        }packets;
+        CompactMessageContent messageContent = {};
+    }payload;
+    SRequestSendCompactFile(const Uuid &id, const transfer_id_t transferId) : header(id, SENDING_FILE_DATA) {
+        payload.transferId = transferId;
+        payload.packets.packetNumber = FIRST_TRY;
+    }
+    csize_t setPayloadSize(csize_t messageSize){
+        return (header.payloadSize = sizeof(payload.transferId) + sizeof(payload.packets) + messageSize);
+    }
+};
+
+// Acknowledges a packet of the large layouts, PACKET_REJECTED replies have the same layout.
+struct SResponseLargePacketReceived
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid            clientId = {};
+        LargeMessageNum packetNumber = DEF_VAL;
+    }payload;
+};
+
+struct SResponseReceivedValidLargeFile
+{
+    SResponseHeader header;
+    struct
+    {
+        Uuid   clientId = {};
+        LargeContentSize contentSize = {};
+        FileName fileName = {};
+        CRC cksum = DEF_VAL;
+    }payload;
+};
+
 struct SendMessage{
     SRequestHeader header;
     FileName fileName = {};
@@ -215,5 +528,34 @@ struct SendMessage{
     }
 };
 
+struct SRequestCapabilities
+{
+    SRequestHeader header;
+    struct
+    {
+        window_t windowSize = DEF_VAL;  // the largest window the client would use.
+        uint8_t  cipherModes = DEF_VAL; // bit per ECipherMode the client supports.
+        csize_t  frameSize = DEF_VAL;   // the largest request frame the client would send.
+    }payload;
+    // its payload size counts the padding of a PACKET_SIZE frame, servers of every version read it whole
+    SRequestCapabilities(const window_t maxWindowSize, const csize_t maxFrameSize) :
+                         header(CAPABILITIES, PACKET_SIZE - sizeof(SRequestHeader)) {
+        payload.windowSize = maxWindowSize;
+        payload.cipherModes = SUPPORTED_CIPHER_MODES;
+        payload.frameSize = maxFrameSize;
+    }
+};
+
+struct SResponseCapabilities
+{
+    SResponseHeader header;
+    struct
+    {
+        window_t      windowSize = DEF_VAL;    // the window both sides agreed on.
+        cipher_mode_t cipherMode = CIPHER_CBC; // from CIPHER_MODE_VERSION, the mode the server picked.
+        csize_t       frameSize = PACKET_SIZE; // from FRAME_SIZE_VERSION, the largest frame the server accepts.
+    }payload;
+};
+
 #pragma pack(pop)
 #endif //CLIENT_PROTOCOL_H
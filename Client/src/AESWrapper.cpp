@@ -1,7 +1,10 @@
 #include "AESWrapper.h"
-#include <modes.h>
-#include <aes.h>
 #include <filters.h>
+#include <hkdf.h>
+#include <osrng.h>
+#include <sha.h>
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 
 
@@ -12,16 +15,11 @@ std::string AESWrapper::encrypt(const std::string& plain) const
 
 std::string AESWrapper::encrypt(const uint8_t* plain, size_t length) const
 {
-	CryptoPP::byte iv[CryptoPP::AES::BLOCKSIZE] = { 0 };	// for practical use iv should never be a fixed value!
-
-	CryptoPP::AES::Encryption aesEncryption(_key.data(), AES_KEY_SIZE);
-	CryptoPP::CBC_Mode_ExternalCipher::Encryption cbcEncryption(aesEncryption, iv);
-
-	std::string cipher;
-	CryptoPP::StreamTransformationFilter stfEncryptor(cbcEncryption, new CryptoPP::StringSink(cipher));
-	stfEncryptor.Put(reinterpret_cast<const CryptoPP::byte*>(plain), length);
-	stfEncryptor.MessageEnd();
-
+	Encryptor encryptor(_key);
+	std::string cipher(Encryptor::encryptedSize(length), '\0');
+	auto *output = reinterpret_cast<uint8_t*>(cipher.data());
+	const size_t written = encryptor.update(plain, length, output);
+	encryptor.final(output + written);
 	return cipher;
 }
 
@@ -40,3 +38,271 @@ std::string AESWrapper::decrypt(const uint8_t* cipher, size_t length) const
 
 	return decrypted;
 }
+
+
+AESKey AESWrapper::deriveKey(const AESKey& secret, const uint8_t* salt, size_t saltLength, const std::string& info)
+{
+	AESKey key;
+	CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+	hkdf.DeriveKey(key.data(), key.size(), secret.data(), secret.size(), salt, saltLength,
+	               reinterpret_cast<const CryptoPP::byte*>(info.data()), info.size());
+	return key;
+}
+
+
+AESWrapper::Encryptor::Encryptor(const AESKey& key) : _partialLength(0)
+{
+	const CryptoPP::byte iv[BLOCK_SIZE] = { 0 };	// for practical use iv should never be a fixed value!
+	_cbcEncryption.SetKeyWithIV(key.data(), AES_KEY_SIZE, iv);
+}
+
+/**
+ * Encrypt the next piece of plain text into cipher, the blocks it completed are written
+ * and the rest is held back until the next call.
+ */
+size_t AESWrapper::Encryptor::update(const uint8_t* plain, size_t length, uint8_t* cipher)
+{
+	size_t written = 0;
+
+	// complete the block held back from the previous call
+	if (_partialLength > 0) {
+		const size_t taken = std::min(length, BLOCK_SIZE - _partialLength);
+		std::memcpy(_partial + _partialLength, plain, taken);
+		_partialLength += taken;
+		plain += taken;
+		length -= taken;
+		if (_partialLength < BLOCK_SIZE)
+			return 0;
+		_cbcEncryption.ProcessData(cipher, _partial, BLOCK_SIZE);
+		written = BLOCK_SIZE;
+		_partialLength = 0;
+	}
+
+	// whole blocks go straight from the caller's buffer to the caller's buffer
+	const size_t whole = length / BLOCK_SIZE * BLOCK_SIZE;
+	if (whole > 0)
+		_cbcEncryption.ProcessData(cipher + written, plain, whole);
+	written += whole;
+
+	_partialLength = length - whole;
+	std::memcpy(_partial, plain + whole, _partialLength);
+	return written;
+}
+
+/**
+ * PKCS#7 pad and encrypt the last block into cipher, then get ready for the next message.
+ */
+size_t AESWrapper::Encryptor::final(uint8_t* cipher)
+{
+	const auto padding = static_cast<CryptoPP::byte>(BLOCK_SIZE - _partialLength);
+	std::memset(_partial + _partialLength, padding, padding);
+	_cbcEncryption.ProcessData(cipher, _partial, BLOCK_SIZE);
+	_partialLength = 0;
+
+	const CryptoPP::byte iv[BLOCK_SIZE] = { 0 };
+	_cbcEncryption.Resynchronize(iv);
+	return BLOCK_SIZE;
+}
+
+/**
+ * Size of the cipher text of plainSize bytes, PKCS#7 always adds 1 to 16 bytes.
+ */
+size_t AESWrapper::Encryptor::encryptedSize(size_t plainSize)
+{
+	return (plainSize / BLOCK_SIZE + 1) * BLOCK_SIZE;
+}
+
+
+AESWrapper::CtrEncryptor::CtrEncryptor(const AESKey& key, ThreadPool& pool) : _key(key), _offset(0), _pool(pool)
+{
+	CryptoPP::AutoSeededRandomPool rng;
+	rng.GenerateBlock(_iv, BLOCK_SIZE);
+}
+
+/**
+ * The IV goes first, the receiver starts its counter from it.
+ */
+size_t AESWrapper::CtrEncryptor::start(uint8_t* cipher)
+{
+	std::memcpy(cipher, _iv, BLOCK_SIZE);
+	return BLOCK_SIZE;
+}
+
+/**
+ * Encrypt the next piece of plain text into cipher, on the calling thread.
+ */
+size_t AESWrapper::CtrEncryptor::update(const uint8_t* plain, size_t length, uint8_t* cipher)
+{
+	encrypt(_offset, plain, length, cipher);
+	_offset += length;
+	return length;
+}
+
+/**
+ * Encrypt the next piece of plain text into cipher, split in block aligned pieces among the pool's threads.
+ */
+boost::asio::awaitable<size_t> AESWrapper::CtrEncryptor::updateAsync(const uint8_t* plain, size_t length,
+                                                                     uint8_t* cipher)
+{
+	const size_t pieces = std::min(_pool.size(), length / PARALLEL_MIN_PIECE);
+	if (pieces <= 1)
+		co_return update(plain, length, cipher);
+
+	const size_t pieceSize = (length / pieces + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	std::vector<std::function<void()>> encrypted;
+	for (size_t done = 0; done < length; done += pieceSize) {
+		const size_t size = std::min(pieceSize, length - done);
+		encrypted.emplace_back([this, done, size, plain, cipher]() {
+			encrypt(_offset + done, plain + done, size, cipher + done);
+		});
+	}
+	co_await _pool.all(std::move(encrypted));
+	_offset += length;
+	co_return length;
+}
+
+/**
+ * Encrypt length bytes found at offset of the stream, with a cipher of its own so pieces don't share state.
+ */
+void AESWrapper::CtrEncryptor::encrypt(uint64_t offset, const uint8_t* plain, size_t length, uint8_t* cipher) const
+{
+	CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption ctr;
+	ctr.SetKeyWithIV(_key.data(), AES_KEY_SIZE, _iv);
+	ctr.Seek(offset);
+	ctr.ProcessData(cipher, plain, length);
+}
+
+
+AESWrapper::GcmEncryptor::GcmEncryptor(const AESKey& key, ThreadPool& pool, size_t packetSize) :
+	_key(key), _packetSize(packetSize), _plainSize(packetSize - OVERHEAD), _packetNumber(1), _pool(pool)
+{
+	CryptoPP::AutoSeededRandomPool rng;
+	rng.GenerateBlock(_salt, sizeof(_salt));
+	_partial.reserve(_plainSize);
+}
+
+/**
+ * Seal every packet the plain text completes into cipher on the calling thread, the rest is held back
+ * until the next call.
+ */
+size_t AESWrapper::GcmEncryptor::update(const uint8_t* plain, size_t length, uint8_t* cipher)
+{
+	const size_t written = sealPartial(plain, length, cipher);
+	const size_t packets = length / _plainSize;
+	sealPackets(_packetNumber, plain, packets, cipher + written);
+	return written + holdBack(plain, length, packets);
+}
+
+/**
+ * Seal every packet the plain text completes into cipher, whole packets split among the pool's threads.
+ */
+boost::asio::awaitable<size_t> AESWrapper::GcmEncryptor::updateAsync(const uint8_t* plain, size_t length,
+                                                                     uint8_t* cipher)
+{
+	const size_t packets = (_partial.size() + length) / _plainSize;
+	const size_t tasks = std::min(_pool.size(), packets * _plainSize / PARALLEL_MIN_PIECE);
+	if (tasks <= 1)
+		co_return update(plain, length, cipher);
+
+	const size_t written = sealPartial(plain, length, cipher);
+	const size_t whole = length / _plainSize;
+	const size_t perTask = (whole + tasks - 1) / tasks;
+	std::vector<std::function<void()>> sealed;
+	for (size_t done = 0; done < whole; done += perTask) {
+		const size_t count = std::min(perTask, whole - done);
+		sealed.emplace_back([this, done, count, plain, cipher, written]() {
+			sealPackets(_packetNumber + done, plain + done * _plainSize, count,
+			            cipher + written + done * _packetSize);
+		});
+	}
+	co_await _pool.all(std::move(sealed));
+	co_return written + holdBack(plain, length, whole);
+}
+
+/**
+ * Complete the packet held back from the previous call and seal it, plain and length are moved past what it took.
+ */
+size_t AESWrapper::GcmEncryptor::sealPartial(const uint8_t*& plain, size_t& length, uint8_t* cipher)
+{
+	if (_partial.empty())
+		return 0;
+	const size_t taken = std::min(length, _plainSize - _partial.size());
+	_partial.insert(_partial.end(), plain, plain + taken);
+	plain += taken;
+	length -= taken;
+	if (_partial.size() < _plainSize)
+		return 0;
+	sealPackets(_packetNumber++, _partial.data(), 1, cipher);
+	_partial.clear();
+	return _packetSize;
+}
+
+/**
+ * Count the packets sealed from plain, and hold back what's left of it for the next call.
+ */
+size_t AESWrapper::GcmEncryptor::holdBack(const uint8_t* plain, size_t length, size_t packets)
+{
+	_packetNumber += packets;
+	_partial.insert(_partial.end(), plain + packets * _plainSize, plain + length);
+	return packets * _packetSize;
+}
+
+/**
+ * Seal the last, shorter packet. An empty stream still gets a packet, with only a tag to check.
+ */
+size_t AESWrapper::GcmEncryptor::final(uint8_t* cipher)
+{
+	if (_partial.empty() && _packetNumber > 1)
+		return 0;
+	CryptoPP::GCM<CryptoPP::AES>::Encryption gcm;
+	gcm.SetKey(_key.data(), AES_KEY_SIZE);
+	seal(gcm, _packetNumber++, _partial.data(), _partial.size(), cipher);
+	const size_t written = _partial.size() + OVERHEAD;
+	_partial.clear();
+	return written;
+}
+
+size_t AESWrapper::GcmEncryptor::outputBound(size_t length) const
+{
+	return (_partial.size() + length) / _plainSize * _packetSize + _packetSize;
+}
+
+/**
+ * Size of all packets sealed for plainSize bytes, at least one.
+ */
+uint64_t AESWrapper::GcmEncryptor::cipherSize(uint64_t plainSize) const
+{
+	const uint64_t packets = std::max<uint64_t>(1, (plainSize + _plainSize - 1) / _plainSize);
+	return plainSize + packets * OVERHEAD;
+}
+
+/**
+ * Seal consecutive whole packets, the key is expanded once for all of them.
+ */
+void AESWrapper::GcmEncryptor::sealPackets(uint64_t firstPacket, const uint8_t* plain, size_t packets,
+                                           uint8_t* sealed) const
+{
+	if (packets == 0)
+		return;
+	CryptoPP::GCM<CryptoPP::AES>::Encryption gcm;
+	gcm.SetKey(_key.data(), AES_KEY_SIZE);
+	for (size_t i = 0; i < packets; i++)
+		seal(gcm, firstPacket + i, plain + i * _plainSize, _plainSize, sealed + i * _packetSize);
+}
+
+/**
+ * Write nonce, cipher text and tag of a packet. Its little endian packet number is authenticated
+ * along, so a packet can't be passed off as another one.
+ */
+void AESWrapper::GcmEncryptor::seal(CryptoPP::GCM<CryptoPP::AES>::Encryption& gcm, uint64_t packetNumber,
+                                    const uint8_t* plain, size_t length, uint8_t* sealed) const
+{
+	CryptoPP::byte number[sizeof(uint64_t)];
+	for (size_t i = 0; i < sizeof(number); i++)
+		number[i] = static_cast<CryptoPP::byte>(packetNumber >> (8 * i));
+
+	std::memcpy(sealed, _salt, sizeof(_salt));
+	std::memcpy(sealed + sizeof(_salt), number, sizeof(number));
+	gcm.EncryptAndAuthenticate(sealed + NONCE_SIZE, sealed + NONCE_SIZE + length, TAG_SIZE,
+	                           sealed, NONCE_SIZE, number, sizeof(number), plain, length);
+}
@@ -6,20 +6,42 @@
 #include <iostream>
 using boost::asio::ip::tcp;
 using boost::asio::io_context;
+using boost::asio::awaitable;
+using boost::asio::redirect_error;
+using boost::asio::use_awaitable;
 
-CSocketHandler::CSocketHandler() : _ioContext(nullptr), _resolver(nullptr), _socket(nullptr), _connected(false)
+CSocketHandler::CSocketHandler() : _ioContext(new io_context), _ownsContext(true), _resolver(nullptr), _socket(nullptr),
+                                   _connected(false), _sessionMode(false), _perRequest(false), _exactFraming(false)
+{
+}
+
+CSocketHandler::CSocketHandler(io_context &context) : _ioContext(&context), _ownsContext(false), _resolver(nullptr),
+                                   _socket(nullptr), _connected(false), _sessionMode(false), _perRequest(false),
+                                   _exactFraming(false)
 {
-    union   // Test for endianness
-    {
-        uint32_t i;
-        uint8_t c[sizeof(uint32_t)];
-    }tester{ 1 };
-    _bigEndian = (tester.c[0] == 0);
 }
 
 CSocketHandler::~CSocketHandler()
 {
     close();
+    delete _resolver;
+    if (_ownsContext)
+        delete _ioContext;
+}
+
+/**
+ * A handler of the same server, framed the same way and on the same io_context. It opens its own connection.
+ */
+std::unique_ptr<CSocketHandler> CSocketHandler::sibling() const
+{
+    auto sibling = std::make_unique<CSocketHandler>(*_ioContext);
+    sibling->_address      = _address;
+    sibling->_port         = _port;
+    sibling->_endpoints    = _endpoints;
+    sibling->_sessionMode  = _sessionMode;
+    sibling->_perRequest   = _perRequest;
+    sibling->_exactFraming = _exactFraming;
+    return sibling;
 }
 
 /**
@@ -31,6 +53,11 @@ bool CSocketHandler::setSocketInfo(const std::string& address, const std::string
     {
         return false;
     }
+    if (address != _address || port != _port)
+    {
+        close();
+        _endpoints = tcp::resolver::results_type();  // resolve the new address on next connect.
+    }
     _address = address;
     _port    = port;
 
@@ -75,28 +102,27 @@ bool CSocketHandler::isValidPort(const std::string& port)
 
 /**
  * Clear socket and connect to new socket.
+ * The resolver and resolved endpoints are created once and reused by every connection.
  */
-bool CSocketHandler::connect()
+awaitable<bool> CSocketHandler::connectAsync()
 {
     if (!isValidAddress(_address) || !isValidPort(_port))
-        return false;
-    try
-    {
-        close();  // close and clear the current socket before new allocations.
-        _ioContext = new io_context;
-        _resolver  = new tcp::resolver(*_ioContext);
-        _socket    = new tcp::socket(*_ioContext);
+        co_return false;
 
-        boost::asio::connect(*_socket, _resolver->resolve(
-                _address, _port, tcp::resolver::query::canonical_name));
-        _socket->non_blocking(false);  // blocking socket..
-        _connected = true;
-    }
-    catch(...)
-    {
-        _connected = false;
-    }
-    return _connected;
+    close();  // close and clear the current socket before new allocations.
+    boost::system::error_code errorCode;
+    if (_resolver == nullptr)
+        _resolver  = new tcp::resolver(*_ioContext);
+    if (_endpoints.empty())
+        _endpoints = co_await _resolver->async_resolve(_address, _port, tcp::resolver::query::canonical_name,
+                                                       redirect_error(use_awaitable, errorCode));
+    if (errorCode)
+        co_return false;
+    _socket    = new tcp::socket(*_ioContext);
+
+    co_await boost::asio::async_connect(*_socket, _endpoints, redirect_error(use_awaitable, errorCode));
+    _connected = !errorCode;
+    co_return _connected;
 }
 
 /**
@@ -110,123 +136,202 @@ void CSocketHandler::close()
             _socket->close();
     }
     catch (...) {} // Do Nothing
-    delete _ioContext;
-    delete _resolver;
     delete _socket;
-    _ioContext = nullptr;
-    _resolver  = nullptr;
     _socket    = nullptr;
     _connected = false;
 }
 
 /**
- * Sending a request to the server and receiving a response with receiveSize size
+ * Check whether a kept connection can't be reused: the server closed it after its last reply,
+ * or it holds unexpected bytes that would be mistaken for the next response.
  */
-bool
-CSocketHandler::communicate(const std::vector<uint8_t> &toSend, std::vector<uint8_t> &response, csize_t receiveSize) {
-    if (!connect()) {
-        return false;
-    }
-    if (!sendData(toSend)) {
-        close();
-        return false;
-    }
-    if (!receiveData(response, receiveSize)) {
-        close();
-        return false;
-    }
-    close();
-    return true;
+bool CSocketHandler::isPeerClosed()
+{
+    if (_socket == nullptr || !_connected)
+        return true;
+
+    boost::system::error_code errorCode;
+    boost::system::error_code modeError;
+    uint8_t probe;
+    _socket->non_blocking(true, modeError);
+    _socket->receive(boost::asio::buffer(&probe, sizeof(probe)), tcp::socket::message_peek, errorCode);
+    _socket->non_blocking(false, modeError);
+
+    return errorCode != boost::asio::error::would_block;
 }
 
 /**
- * receiving a response from the server, handling big data
+ * Sending a request to the server and receiving its response into the caller's storage.
+ * In session mode the connection stays open for the next request. A stale connection is
+ * replaced transparently, and a server that closes after each reply turns session mode off.
  */
-bool CSocketHandler::receiveData(std::vector<uint8_t> &buffer, csize_t bytesToReceive) {
-    if (_socket == nullptr || !_connected  || bytesToReceive == 0)
-        return false;
-
-    buffer.clear();
-    buffer.reserve(bytesToReceive);
-
-    csize_t bytesReceived = 0;
-    std::vector<uint8_t> tempBuffer(PACKET_SIZE, 0);
-
-    while (bytesReceived < bytesToReceive)
-    {
-        boost::system::error_code errorCode;
-        csize_t bytesRead = read(*_socket, boost::asio::buffer(tempBuffer, PACKET_SIZE),
-                                 errorCode);
-
-        if (errorCode || bytesRead == 0) {
-            return false;
-        }
-
-        if (_bigEndian) {
-            convertEndianess(tempBuffer.data(), bytesRead);
+awaitable<bool>
+CSocketHandler::communicateAsync(SFrame toSend, std::span<uint8_t> response) {
+    if (!isSessionMode()) {
+        const bool connected = co_await connectAsync();
+        if (!connected) {
+            co_return false;
         }
+        const bool success = co_await exchangeAsync(toSend, response);
+        close();
+        co_return success;
+    }
 
-        csize_t bytesToCopy = std::min(bytesRead, bytesToReceive - bytesReceived);
-        buffer.insert(buffer.end(), tempBuffer.begin(), tempBuffer.begin() + bytesToCopy);
-
-
-        bytesReceived += bytesToCopy;
+    bool reused = _connected;
+    if (reused && isPeerClosed()) {
+        _perRequest = true;  // the server closed the connection after its last reply.
+        reused = false;
+    }
+    if (!reused) {
+        const bool connected = co_await connectAsync();
+        if (!connected)
+            co_return false;
+    }
+    const bool exchanged = co_await exchangeAsync(toSend, response);
+    if (exchanged) {
+        if (_perRequest)
+            close();
+        co_return true;
+    }
+    close();
+    if (!reused) {
+        co_return false;
     }
 
-    return true;
+    // the kept connection was dropped under us, retry once on a fresh one.
+    _perRequest = true;
+    const bool connected = co_await connectAsync();
+    if (!connected) {
+        co_return false;
+    }
+    const bool success = co_await exchangeAsync(toSend, response);
+    close();
+    co_return success;
 }
 
 /**
- * sending a request to the server, handling big data
+ * Make sure the session connection is usable before pipelining requests over it.
  */
-bool CSocketHandler::sendData(const std::vector<uint8_t> &buffer) {
-    if (_socket == nullptr || !_connected || buffer.empty())
-        return false;
-
-    std::vector<uint8_t> tempBuffer(PACKET_SIZE);
-
-    csize_t bytesSent = 0;
-    while (bytesSent < buffer.size())
-    {
-        csize_t bytesToSend = std::min(PACKET_SIZE, static_cast<csize_t>(buffer.size() - bytesSent));
-        std::copy(buffer.begin() + bytesSent, buffer.begin() + bytesSent + bytesToSend,
-                  tempBuffer.begin());
-
-        if (_bigEndian) {
-            convertEndianess(tempBuffer.data(), bytesToSend);
-        }
-
-        boost::system::error_code errorCode;
-        size_t bytesWritten = write(*_socket,boost::asio::buffer(tempBuffer, PACKET_SIZE),
-                                    errorCode);
+awaitable<bool> CSocketHandler::openSessionAsync() {
+    if (!isSessionMode())
+        co_return false;
+    if (_connected && !isPeerClosed())
+        co_return true;
+    co_return co_await connectAsync();
+}
 
-        if (errorCode || bytesWritten == 0) {
-            return false;
-        }
+/**
+ * Send a request over the session connection without waiting for its response.
+ */
+awaitable<bool> CSocketHandler::sendAsync(SFrame toSend) {
+    const bool sent = co_await sendData(toSend);
+    if (!sent) {
+        close();
+        co_return false;
+    }
+    co_return true;
+}
 
-        bytesSent += bytesWritten;
+/**
+ * Receive the next pending response over the session connection.
+ */
+awaitable<bool> CSocketHandler::receiveAsync(std::span<uint8_t> response) {
+    const bool received = co_await receiveData(response);
+    if (!received) {
+        close();
+        co_return false;
     }
+    co_return true;
+}
 
-    return true;
+/**
+ * Send a request and receive its response over the current connection.
+ */
+awaitable<bool> CSocketHandler::exchangeAsync(SFrame toSend, std::span<uint8_t> response) {
+    const bool sent = co_await sendData(toSend);
+    if (!sent)
+        co_return false;
+    co_return co_await receiveData(response);
 }
 
+/**
+ * receiving a response from the server into the caller's storage, a padded response fills whole PACKET_SIZE frames.
+ * The frames' bytes past the storage are read into the discard buffer, nothing is allocated.
+ */
+awaitable<bool> CSocketHandler::receiveData(std::span<uint8_t> response) {
+    if (_socket == nullptr || !_connected  || response.empty())
+        co_return false;
+    if (_exactFraming)
+        co_return co_await receiveFrame(response);
+
+    const size_t frameSize = (response.size() + PACKET_SIZE - 1) / PACKET_SIZE * PACKET_SIZE;
+    const std::array<boost::asio::mutable_buffer, 2> buffers = {
+            boost::asio::buffer(response.data(), response.size()),
+            boost::asio::buffer(_discard.data(), frameSize - response.size())};
+
+    boost::system::error_code errorCode;
+    co_await boost::asio::async_read(*_socket, buffers, redirect_error(use_awaitable, errorCode));
+    co_return !errorCode;
+}
 
 /**
- * Handle Endianness.
+ * receiving a response framed exactly: its header, then the payload size the header tells, into the caller's storage.
+ * A payload longer than the storage is read past, the storage past a shorter one is zero filled.
  */
-void CSocketHandler::convertEndianess(uint8_t* const buffer, size_t size)
-{
-    if (buffer == nullptr || size < sizeof(uint32_t))
-        return;
+awaitable<bool> CSocketHandler::receiveFrame(std::span<uint8_t> response) {
+    constexpr size_t payloadSizeOffset = sizeof(version_t) + sizeof(code_t);
+    if (response.size() < sizeof(SResponseHeader))
+        co_return false;
+
+    boost::system::error_code errorCode;
+    co_await boost::asio::async_read(*_socket, boost::asio::buffer(response.data(), sizeof(SResponseHeader)),
+                                     redirect_error(use_awaitable, errorCode));
+    if (errorCode)
+        co_return false;
+
+    // the payload size is little endian, whatever the host is
+    csize_t payloadSize = 0;
+    for (size_t i = 0; i < sizeof(csize_t); i++)
+        payloadSize |= (csize_t)response[payloadSizeOffset + i] << (8 * i);
+    if (payloadSize > MAX_FRAME_SIZE)
+        co_return false;
+
+    const size_t stored = std::min<size_t>(payloadSize, response.size() - sizeof(SResponseHeader));
+    co_await boost::asio::async_read(*_socket, boost::asio::buffer(response.data() + sizeof(SResponseHeader), stored),
+                                     redirect_error(use_awaitable, errorCode));
+    for (size_t left = payloadSize - stored; !errorCode && left > 0;)
+        left -= co_await boost::asio::async_read(*_socket,
+                                                 boost::asio::buffer(_discard.data(), std::min(left, _discard.size())),
+                                                 redirect_error(use_awaitable, errorCode));
+    if (errorCode)
+        co_return false;
+
+    std::fill(response.begin() + (std::ptrdiff_t)(sizeof(SResponseHeader) + stored), response.end(), 0);
+    co_return true;
+}
 
-    size_t numInts = size / sizeof(uint32_t);
-    auto* intBuffer = reinterpret_cast<uint32_t*>(buffer);
+/**
+ * sending a request to the server, as a single frame.
+ * A request shorter than PACKET_SIZE is padded to it, a longer one (up to the negotiated frame size)
+ * is sent as it is, the payload size in its header tells the server where it ends.
+ * With exact framing no request is padded.
+ */
+awaitable<bool> CSocketHandler::sendData(SFrame frame) {
+    if (_socket == nullptr || !_connected || frame.size() == 0)
+        co_return false;
 
-    for (size_t i = 0; i < numInts; ++i)
-    {
-        intBuffer[i] = htonl(intBuffer[i]);
-    }
+    // the padding of frames shorter than PACKET_SIZE, every frame pads from the same zeros
+    static constexpr std::array<uint8_t, PACKET_SIZE> padding = {};
+    const size_t frameSize = _exactFraming ? frame.size() : std::max<size_t>(PACKET_SIZE, frame.size());
 
-}
+    // one gathering write, the content goes from where it lies without being copied into the frame
+    const std::array<boost::asio::const_buffer, 3> buffers = {
+            boost::asio::buffer(frame.head.data(), frame.head.size()),
+            boost::asio::buffer(frame.body.data(), frame.body.size()),
+            boost::asio::buffer(padding.data(), frameSize - frame.size())};
 
+    boost::system::error_code errorCode;
+    size_t bytesWritten = co_await boost::asio::async_write(*_socket, buffers, redirect_error(use_awaitable, errorCode));
 
+    co_return !errorCode && bytesWritten == frameSize;
+}
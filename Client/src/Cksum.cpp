@@ -1,6 +1,7 @@
 #include "Chksum.h"
 #include "protocol.h"
 
+constexpr uint_fast32_t CRC_POLYNOMIAL = 0x04c11db7;    // crctab[0][1]
 
 uint_fast32_t const crctab[8][256] = {
         {
@@ -437,23 +438,149 @@ uint_fast32_t const crctab[8][256] = {
         },
 };
 
+/**
+ * POSIX cksum of a buffer, using the fastest kernel this cpu supports.
+ */
 CRC Chksum::memcrc(const char * b, size_t n) {
-    unsigned int c;
-    CRC s = 0;
+    const auto *data = reinterpret_cast<const unsigned char *>(b);
+    return finish(update(0, data, n), n);
+}
+
+/**
+ * POSIX cksum of a buffer, one byte per table lookup.
+ * Kept as the reference the faster kernels are checked against.
+ */
+CRC Chksum::memcrcReference(const char * b, size_t n) {
+    const auto *data = reinterpret_cast<const unsigned char *>(b);
+    return finish(updateBytewise(0, data, n), n);
+}
+
+/**
+ * Feed the next chunk of data into the crc.
+ */
+void Chksum::update(std::span<const uint8_t> data) {
+    _state = update(_state, data.data(), data.size());
+    _length += data.size();
+}
+
+void Chksum::update(std::string_view data) {
+    update(std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(data.data()), data.size()));
+}
+
+/**
+ * The POSIX cksum of all the data fed, which must add up to totalLength bytes.
+ */
+CRC Chksum::finalize(uint64_t totalLength) const {
+    return finish(_state, totalLength);
+}
+
+/**
+ * Append a checksum of the data that follows this one, as if it was fed through update().
+ * Like zlib's crc32_combine: the register is linear, so it's this register shifted past
+ * next's bytes xor next's register.
+ */
+void Chksum::combine(const Chksum &next) {
+    _state = shiftBytes(_state, next._length) ^ next._state;
+    _length += next._length;
+}
+
+/**
+ * Checksum a block on the pool, while the caller goes on with it, e.g. encrypting it.
+ * The blocks' checksums are combined in the file's order.
+ */
+ThreadPool::Pending<Chksum> Chksum::start(std::span<const uint8_t> block, ThreadPool &pool) {
+    return pool.start([block]() {
+        Chksum partial;
+        partial.update(block);
+        return partial;
+    });
+}
+
+/**
+ * a * b mod P, polynomials over GF(2) in the (non reflected) register layout.
+ */
+uint_fast32_t Chksum::multiplyModPoly(uint_fast32_t a, uint_fast32_t b) {
+    uint_fast32_t product = 0;
+
+    for (int bit = 31; bit >= 0; bit--) {
+        product = (product & 0x80000000) ? UNSIGNED(product << 1) ^ CRC_POLYNOMIAL : UNSIGNED(product << 1);
+        if ((b >> bit) & 1)
+            product ^= a;
+    }
+    return product;
+}
+
+/**
+ * The register after feeding it n zero bytes: s * x^(8n) mod P, by square and multiply.
+ */
+uint_fast32_t Chksum::shiftBytes(uint_fast32_t s, uint64_t n) {
+    uint_fast32_t power = 0x100;    // x^8, one byte
+    while (n) {
+        if (n & 1)
+            s = multiplyModPoly(s, power);
+        power = multiplyModPoly(power, power);
+        n >>= 1;
+    }
+    return s;
+}
+
+/**
+ * Pick the kernel once: carry-less multiply folding when the cpu has it, slicing-by-8 otherwise.
+ */
+Chksum::UpdateKernel Chksum::selectKernel() {
+    return hasFoldingSupport() ? &Chksum::updateFolded : &Chksum::updateSlice8;
+}
+
+/**
+ * Feed n bytes into the crc register with the selected kernel.
+ */
+uint_fast32_t Chksum::update(uint_fast32_t s, const unsigned char * b, size_t n) {
+    static const UpdateKernel kernel = selectKernel();
+    return kernel(s, b, n);
+}
+
+/**
+ * Feed n bytes into the crc register, one byte per table lookup.
+ */
+uint_fast32_t Chksum::updateBytewise(uint_fast32_t s, const unsigned char * b, size_t n) {
     unsigned int tabidx;
-    
-    for (int i = 0; i < n; i++) {
-        tabidx = (s >> 24) ^ (unsigned char)b[i];
+
+    for (size_t i = 0; i < n; i++) {
+        tabidx = (s >> 24) ^ b[i];
         s = UNSIGNED((s << 8)) ^ crctab[0][tabidx];
     }
-    
+    return s;
+}
+
+/**
+ * Feed n bytes into the crc register, 8 bytes per iteration using all eight tables.
+ * Bytes are assembled big-endian, so the result doesn't depend on the host's endianness.
+ */
+uint_fast32_t Chksum::updateSlice8(uint_fast32_t s, const unsigned char * b, size_t n) {
+    while (n >= 8) {
+        const uint_fast32_t first = s ^ ((uint_fast32_t)b[0] << 24 | (uint_fast32_t)b[1] << 16 |
+                                         (uint_fast32_t)b[2] << 8 | b[3]);
+        s = crctab[7][(first >> 24) & 0xff] ^ crctab[6][(first >> 16) & 0xff] ^
+            crctab[5][(first >> 8) & 0xff] ^ crctab[4][first & 0xff] ^
+            crctab[3][b[4]] ^ crctab[2][b[5]] ^ crctab[1][b[6]] ^ crctab[0][b[7]];
+        b += 8;
+        n -= 8;
+    }
+    return updateBytewise(s, b, n);
+}
+
+/**
+ * Append the length of the data, least significant byte first, and complement the register.
+ */
+CRC Chksum::finish(uint_fast32_t s, uint64_t n) {
+    unsigned int c;
+
     while (n) {
         c = n & 0377;
         n = n >> 8;
         s = UNSIGNED(s << 8) ^ crctab[0][(s >> 24) ^ c];
     }
     return (CRC)UNSIGNED(~s);
-
 }
 
  bool Chksum::readFile(std::string &fName, std::string &fContent, CRC &crc, csize_t fileSize) {
@@ -462,11 +589,17 @@ CRC Chksum::memcrc(const char * b, size_t n) {
 
     std::ifstream f1(fName.c_str(), std::ios::binary);
 
-    // save file content
+    // save file content, checksumming each block while it's still in cache
+    constexpr size_t blockSize = 1 << 16;
+    Chksum chksum;
     fContent.resize(fileSize);
-    f1.read(fContent.data(), fileSize);
+    for (size_t offset = 0; offset < fileSize; offset += blockSize) {
+        const size_t length = std::min<size_t>(blockSize, fileSize - offset);
+        f1.read(fContent.data() + offset, (std::streamsize)length);
+        chksum.update(std::string_view(fContent.data() + offset, length));
+    }
 
     // save crc
-    crc = memcrc(fContent.data(), fileSize);
+    crc = chksum.finalize(fileSize);
     return true;
 }
\ No newline at end of file
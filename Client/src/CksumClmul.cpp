@@ -0,0 +1,197 @@
+//
+// Carry-less multiply folding kernels for the POSIX cksum crc (polynomial 0x04C11DB7, not reflected).
+// Based on Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+//
+#include "Chksum.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CKSUM_CLMUL_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CKSUM_PMULL_ARM
+#include <arm_neon.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+// Folding constants, x^n mod P. Each 128-bit block is folded as hi * x^(d+64) + lo * x^d.
+constexpr uint64_t FOLD_1_HI = 0xC5B9CD4C;  // x^192, folds one 16-byte block onto the next
+constexpr uint64_t FOLD_1_LO = 0xE8A45605;  // x^128
+constexpr uint64_t FOLD_4_HI = 0x8833794C;  // x^576, folds four 16-byte blocks onto the next four
+constexpr uint64_t FOLD_4_LO = 0xE6228B11;  // x^512
+constexpr size_t   FOLD_MIN_SIZE = 64;      // shorter buffers go through the table kernel
+
+#if defined(CKSUM_CLMUL_X86)
+
+/**
+ * Check cpuid for PCLMULQDQ, and SSSE3 that is needed for byte swapping the blocks.
+ */
+bool Chksum::hasFoldingSupport() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+namespace {
+    __attribute__((target("pclmul,ssse3")))
+    inline __m128i loadBlock(const unsigned char * b, const __m128i shuffle) {
+        return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)), shuffle);
+    }
+
+    __attribute__((target("pclmul,ssse3")))
+    inline __m128i fold(const __m128i x, const __m128i constant) {
+        return _mm_xor_si128(_mm_clmulepi64_si128(x, constant, 0x00), _mm_clmulepi64_si128(x, constant, 0x11));
+    }
+}
+
+/**
+ * Feed n bytes into the crc register, folding 64 bytes per iteration with PCLMULQDQ.
+ */
+__attribute__((target("pclmul,ssse3")))
+uint_fast32_t Chksum::updateFolded(uint_fast32_t s, const unsigned char * b, size_t n) {
+    if (n < FOLD_MIN_SIZE)
+        return updateSlice8(s, b, n);
+
+    // Byte swap a whole register, so the first byte of a block is its most significant one
+    const __m128i shuffle = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i fold1 = _mm_set_epi64x(FOLD_1_HI, FOLD_1_LO);
+    const __m128i fold4 = _mm_set_epi64x(FOLD_4_HI, FOLD_4_LO);
+
+    // The current register is xor-ed into the top 32 bits of the first block
+    __m128i x0 = _mm_xor_si128(loadBlock(b, shuffle), _mm_set_epi32((int)s, 0, 0, 0));
+    __m128i x1 = loadBlock(b + 16, shuffle);
+    __m128i x2 = loadBlock(b + 32, shuffle);
+    __m128i x3 = loadBlock(b + 48, shuffle);
+    b += 64;
+    n -= 64;
+
+    // Fold four blocks in parallel onto the next four
+    while (n >= 64) {
+        x0 = _mm_xor_si128(fold(x0, fold4), loadBlock(b, shuffle));
+        x1 = _mm_xor_si128(fold(x1, fold4), loadBlock(b + 16, shuffle));
+        x2 = _mm_xor_si128(fold(x2, fold4), loadBlock(b + 32, shuffle));
+        x3 = _mm_xor_si128(fold(x3, fold4), loadBlock(b + 48, shuffle));
+        b += 64;
+        n -= 64;
+    }
+
+    // Fold the four blocks into one, then the remaining whole blocks into it
+    x0 = _mm_xor_si128(fold(x0, fold1), x1);
+    x0 = _mm_xor_si128(fold(x0, fold1), x2);
+    x0 = _mm_xor_si128(fold(x0, fold1), x3);
+    while (n >= 16) {
+        x0 = _mm_xor_si128(fold(x0, fold1), loadBlock(b, shuffle));
+        b += 16;
+        n -= 16;
+    }
+
+    // The folded block stands for everything consumed so far, finish it and the tail with the tables
+    alignas(16) unsigned char folded[16];
+    _mm_store_si128(reinterpret_cast<__m128i *>(folded), _mm_shuffle_epi8(x0, shuffle));
+    return updateSlice8(updateSlice8(0, folded, sizeof(folded)), b, n);
+}
+
+#elif defined(CKSUM_PMULL_ARM)
+
+#if defined(__clang__)
+#define CKSUM_PMULL_TARGET __attribute__((target("aes")))
+#else
+#define CKSUM_PMULL_TARGET __attribute__((target("+crypto")))
+#endif
+
+/**
+ * Check the hardware capabilities for the 64-bit polynomial multiply (PMULL).
+ */
+bool Chksum::hasFoldingSupport() {
+#if defined(__APPLE__)
+    int supported = 0;
+    size_t size = sizeof(supported);
+    return sysctlbyname("hw.optional.arm.FEAT_PMULL", &supported, &size, nullptr, 0) == 0 && supported;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#else
+    return false;
+#endif
+}
+
+namespace {
+    CKSUM_PMULL_TARGET
+    inline uint64x2_t loadBlock(const unsigned char * b) {
+        // reverse all 16 bytes, lane 1 holds the first 8 bytes as a big-endian number
+        const uint8x16_t reversed = vrev64q_u8(vld1q_u8(b));
+        return vreinterpretq_u64_u8(vextq_u8(reversed, reversed, 8));
+    }
+
+    CKSUM_PMULL_TARGET
+    inline uint64x2_t fold(const uint64x2_t x, const uint64_t hi, const uint64_t lo) {
+        const poly128_t high = vmull_p64((poly64_t)vgetq_lane_u64(x, 1), (poly64_t)hi);
+        const poly128_t low = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), (poly64_t)lo);
+        return veorq_u64(vreinterpretq_u64_p128(high), vreinterpretq_u64_p128(low));
+    }
+}
+
+/**
+ * Feed n bytes into the crc register, folding 64 bytes per iteration with PMULL.
+ */
+CKSUM_PMULL_TARGET
+uint_fast32_t Chksum::updateFolded(uint_fast32_t s, const unsigned char * b, size_t n) {
+    if (n < FOLD_MIN_SIZE)
+        return updateSlice8(s, b, n);
+
+    // The current register is xor-ed into the top 32 bits of the first block
+    const uint64x2_t initial = vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)s << 32));
+    uint64x2_t x0 = veorq_u64(loadBlock(b), initial);
+    uint64x2_t x1 = loadBlock(b + 16);
+    uint64x2_t x2 = loadBlock(b + 32);
+    uint64x2_t x3 = loadBlock(b + 48);
+    b += 64;
+    n -= 64;
+
+    // Fold four blocks in parallel onto the next four
+    while (n >= 64) {
+        x0 = veorq_u64(fold(x0, FOLD_4_HI, FOLD_4_LO), loadBlock(b));
+        x1 = veorq_u64(fold(x1, FOLD_4_HI, FOLD_4_LO), loadBlock(b + 16));
+        x2 = veorq_u64(fold(x2, FOLD_4_HI, FOLD_4_LO), loadBlock(b + 32));
+        x3 = veorq_u64(fold(x3, FOLD_4_HI, FOLD_4_LO), loadBlock(b + 48));
+        b += 64;
+        n -= 64;
+    }
+
+    // Fold the four blocks into one, then the remaining whole blocks into it
+    x0 = veorq_u64(fold(x0, FOLD_1_HI, FOLD_1_LO), x1);
+    x0 = veorq_u64(fold(x0, FOLD_1_HI, FOLD_1_LO), x2);
+    x0 = veorq_u64(fold(x0, FOLD_1_HI, FOLD_1_LO), x3);
+    while (n >= 16) {
+        x0 = veorq_u64(fold(x0, FOLD_1_HI, FOLD_1_LO), loadBlock(b));
+        b += 16;
+        n -= 16;
+    }
+
+    // The folded block stands for everything consumed so far, finish it and the tail with the tables
+    unsigned char folded[16];
+    const uint64_t hi = vgetq_lane_u64(x0, 1);
+    const uint64_t lo = vgetq_lane_u64(x0, 0);
+    for (int i = 0; i < 8; i++) {
+        folded[i] = (unsigned char)(hi >> (56 - 8 * i));
+        folded[8 + i] = (unsigned char)(lo >> (56 - 8 * i));
+    }
+    return updateSlice8(updateSlice8(0, folded, sizeof(folded)), b, n);
+}
+
+#else
+
+bool Chksum::hasFoldingSupport() {
+    return false;
+}
+
+uint_fast32_t Chksum::updateFolded(uint_fast32_t s, const unsigned char * b, size_t n) {
+    return updateSlice8(s, b, n);
+}
+
+#endif
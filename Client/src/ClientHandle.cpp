@@ -3,76 +3,166 @@
 //
 #include "ClientHandle.h"
 #include <iostream>
+using boost::asio::awaitable;
 
 /**
  * Initialize client's keys & its connection with the server.
  */
-bool ClientHandle::initializeAndConnect(bool &isReconnect) {
+awaitable<bool> ClientHandle::initializeAndConnectAsync(bool &isReconnect) {
     // initializing the client, determining if client's need to register or reconnect.
-    _clientLogic.initialize(isReconnect);
+    if (!_clientLogic.initialize(isReconnect))
+        co_return reportErrorAndStop("Reading the client's info failed");
 
-    // trying to register
-    if (!_clientLogic.isRegistered() && !_clientLogic.registerClient())
-        return reportErrorAndDecrementRetries("Registration failed");
+    // learn the server's version and window, a legacy server is used stop-and-wait.
+    (void)co_await _clientLogic.requestCapabilitiesAsync();
 
-    // trying to reconnect
-    else if (_clientLogic.isRegistered() && !_clientLogic.reconnectClient())
-        return reportErrorAndDecrementRetries("Reconnection failed");
+    // trying to register, a server that exchanged keys with the registration can issue a ticket already
+    if (!_clientLogic.isRegistered()) {
+        const bool registered = co_await _clientLogic.registerClientAsync();
+        if (!registered)
+            co_return reportErrorAndDecrementRetries("Registration failed");
+        if (_clientLogic.isKeyExchanged())
+            (void)co_await _clientLogic.requestTicketAsync();
+        co_return true;
+    }
 
-    return true;
+    // trying to reconnect, the ticket of the previous session skips the key exchange
+    const bool resumed = co_await _clientLogic.resumeSessionAsync();
+    if (!resumed) {
+        const bool reconnected = co_await _clientLogic.reconnectClientAsync();
+        if (!reconnected)
+            co_return reportErrorAndDecrementRetries("Reconnection failed");
+        (void)co_await _clientLogic.requestTicketAsync();
+    }
+
+    co_return true;
 }
 
 /**
  * Exchanging keys with the server.
  */
-bool ClientHandle::exchangeKeys() {
-    if(_clientLogic.sendPublicKey())
-        return true;
-    else
-        return reportErrorAndDecrementRetries("Sending public key failed");
+awaitable<bool> ClientHandle::exchangeKeysAsync() {
+    const bool sent = co_await _clientLogic.sendPublicKeyAsync();
+    if (!sent)
+        co_return reportErrorAndDecrementRetries("Sending public key failed");
+
+    // a ticket for resuming this session on the next run, there's no harm without one
+    (void)co_await _clientLogic.requestTicketAsync();
+    co_return true;
 }
 
 /**
  * Sending a file to the server
  */
-bool ClientHandle::sendFile(bool &isInvalidCRC) {
-    if(_clientLogic.sendEncryptedFileAndCorrespondedCRC(isInvalidCRC))
-        return true;
-    else
-        return reportErrorAndDecrementRetries("Sending file failed");
+awaitable<bool> ClientHandle::sendFileAsync(bool &isInvalidCRC) {
+    const bool sent = co_await _clientLogic.sendEncryptedFileAndCorrespondedCRCAsync(isInvalidCRC);
+    if (!sent)
+        co_return reportErrorAndDecrementRetries("Sending file failed");
+    co_return true;
 }
 
 /**
- * Sending a message indicating the server's crc is valid
+ * Sending a message telling the server whether its crc is valid, or that no further attempts are made.
  */
-bool ClientHandle::sendValidCRC() {
-    if(_clientLogic.sendCRCMessage(CRC_VALID))
-        return true;
-    else
-        return reportErrorAndDecrementRetries("Sending Valid CRC failed");}
-
+awaitable<bool> ClientHandle::sendCRCAsync(const ERequestCode code, const std::string &errorContext) {
+    const bool sent = co_await _clientLogic.sendCRCMessageAsync(code);
+    if (!sent)
+        co_return reportErrorAndDecrementRetries(errorContext);
+    co_return true;
+}
 
 /**
- * Sending a message indicating the server's crc is invalid
+ * A whole session: connecting, exchanging keys unless done with the registration, sending the file and settling
+ * its crc. Each step is retried, true when the server accepted the file.
  */
-bool ClientHandle::sendInvalidCRC() {
-    // Its isn't mentioned in the protocol,
-    // but I assume that in this case the server would respond with code 1604 for a success
-    if(_clientLogic.sendCRCMessage(CRC_INVALID_SENDING_AGAIN))
-        return true;
-    else
-        return reportErrorAndDecrementRetries("Sending Invalid CRC failed");}
+awaitable<bool> ClientHandle::transferAsync() {
+    bool isReconnect = false, succeeded = false;
+    do {
+        // try to connect to the server
+        succeeded = co_await initializeAndConnectAsync(isReconnect);
+    } while (!succeeded && hasRemainingAttempts());
+    if (!succeeded)
+        co_return reportFatalError("All connection attempts failed");
 
+    if (!isReconnect && isKeyExchanged()) {
+        // a single round trip registered the client and exchanged the keys
+        report("registration succeeded, the client is registered and received the server's key");
+    }
+    else if (!isReconnect) {
+        // do not allow if the client is already registered
+        report("registration succeeded, the client is registered");
 
-/**
- * Sending a message indicating the server's crc is invalid thus,
- * there is not further attempts to resend the file
- */
-bool ClientHandle::sendAbort() {
-    if(_clientLogic.sendCRCMessage(CRC_INVALID_FORTH_TIME_IM_DONE))
-        return true;
-    else
-        return reportErrorAndDecrementRetries("Sending abort message failed");}
+        resetTries();
+        do {
+            // try to send our public key, and receive the server's encrypted key
+            succeeded = co_await exchangeKeysAsync();
+        } while (!succeeded && hasRemainingAttempts());
+        if (!succeeded)
+            co_return reportFatalError("All exchanging keys attempts failed");
+
+        report("exchange keys succeeded, we send the client's key and received server's key");
+    }
+    else {
+        report("reconnection succeeded, the client is reconnected");
+    }
+
+    // the file is sent once, then resent up to MAX_RETRIES times while the crc doesn't match
+    bool isInvalidCRC = false;
+    for (int attempt = 0; attempt <= MAX_RETRIES; attempt++) {
+        if (attempt > 0) {
+            report("On the " + std::to_string(attempt) + " attempt:\nSending a file succeeded, "
+                   "server received a valid file and responded with an invalid CRC.");
+            resetTries();
+            do {
+                // Its isn't mentioned in the protocol,
+                // but I assume that in this case the server would respond with code 1604 for a success
+                succeeded = co_await sendCRCAsync(CRC_INVALID_SENDING_AGAIN, "Sending Invalid CRC failed");
+            } while (!succeeded && hasRemainingAttempts());
+            if (!succeeded)
+                co_return reportFatalError("All attempts for sending an invalid crc failed");
+            report("sending an invalid crc succeeded, server responded with a confirmation");
+        }
+
+        resetTries();
+        do {
+            // try to send the file, and get the server's crc of it
+            succeeded = co_await sendFileAsync(isInvalidCRC);
+        } while (!succeeded && hasRemainingAttempts());
+        if (!succeeded)
+            co_return reportFatalError("All sending a file attempts failed");
+
+        // every packet was authenticated on arrival, there is nothing left to confirm with the crc
+        if (!isInvalidCRC && isFileAuthenticated()) {
+            report("sending a file succeeded, server authenticated every packet and responded with a valid CRC"
+                   "\n\nEnding with: Accept");
+            co_return true;
+        }
+        if (!isInvalidCRC) {
+            report("sending a file succeeded, server received a valid file and responded with a valid CRC");
+            resetTries();
+            do {
+                // try to send a message indicating that our crc and the server's crc are equal
+                succeeded = co_await sendCRCAsync(CRC_VALID, "Sending Valid CRC failed");
+            } while (!succeeded && hasRemainingAttempts());
+            if (!succeeded)
+                co_return reportFatalError("All sending a valid crc attempts failed");
+
+            report("sending a valid crc succeeded, server responded with a confirmation\n\nEnding with: Accept");
+            co_return true;
+        }
+    }
+
+    // finished resending the file, the server is told no further attempts are made
+    resetTries();
+    do {
+        succeeded = co_await sendCRCAsync(CRC_INVALID_FORTH_TIME_IM_DONE, "Sending abort message failed");
+    } while (!succeeded && hasRemainingAttempts());
+    if (!succeeded)
+        co_return reportFatalError("All attempts for sending an abort message failed");
+
+    report("sending an abort message succeeded, server responded with a confirmation.\n\nEnding with: Abort");
+    co_return false;
+}
 
 
 /**
@@ -82,8 +172,31 @@ bool ClientHandle::reportErrorAndDecrementRetries(const std::string &errorContex
     std::string attemptNumber = "Attempt " + std::to_string(getAttemptNumber()) + ":\n";
     _currRetry++;
     _errMessage += attemptNumber + errorContext + ": " + _clientLogic.getLastError() + '\n';
-    std::cout << "Server responded with an error" << std::endl;
+    report("Server responded with an error");
     return false;
 }
 
+/**
+ * Record an error no retry would fix, no further attempts are made
+ */
+bool ClientHandle::reportErrorAndStop(const std::string &errorContext) {
+    _isStopped = true;
+    _errMessage += "Attempt " + std::to_string(getAttemptNumber()) + ":\n" + errorContext + ": "
+                   + _clientLogic.getLastError() + '\n';
+    return false;
+}
 
+/**
+ * Print the errors of a step's failed attempts, the session can't go on
+ */
+bool ClientHandle::reportFatalError(const std::string &failedAttempts) const {
+    report("\nFATAL ERROR:\n" + failedAttempts + ". Errors:\n" + _errMessage);
+    return false;
+}
+
+/**
+ * Print a line of the session's progress, whole, so that lines of concurrent sessions don't interleave
+ */
+void ClientHandle::report(const std::string &message) const {
+    std::cout << (_prefix + message + '\n') << std::flush;
+}
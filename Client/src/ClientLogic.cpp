@@ -2,15 +2,31 @@
 // Created by גאי ברנשטיין on 20/09/2024.
 //
 #include "ClientLogic.h"
+#include <filesystem>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/this_coro.hpp>
+using boost::asio::awaitable;
+using boost::asio::redirect_error;
+using boost::asio::use_awaitable;
 
 ClientLogic::ClientLogic() :
-    _fileHandle(std::make_unique<FileHandle>()) , _socketHandler(std::make_unique<CSocketHandler>()),
-    _rsaPrivateWrapper(RSAPrivateWrapper()) {}
+    _fileHandle(std::make_unique<FileHandle>()) , _socketHandler(std::make_unique<CSocketHandler>()) {
+    // keep one connection open for the whole register, key exchange, file and CRC flow
+    _socketHandler->setSessionMode(true);
+}
+
+ClientLogic::ClientLogic(io_context &context, std::string directory) :
+    _directory(std::move(directory)), _fileHandle(std::make_unique<FileHandle>()),
+    _socketHandler(std::make_unique<CSocketHandler>(context)) {
+    _socketHandler->setSessionMode(true);
+}
 
 /**
- * Parses each info file correspondingly to the protocol, and initialize the connection with the server
+ * Parses each info file correspondingly to the protocol, and initialize the connection with the server.
+ * False when they can't be parsed, the error tells why.
  */
-void ClientLogic::initialize(bool &isReconnect) {
+bool ClientLogic::initialize(bool &isReconnect) {
     // first, we check if there's me.info for connecting with the client.
     if (isFileEmptyAndOpen(CLIENT_INFO)) {
         _self._registered = true; // so we'll know which file to parse
@@ -18,77 +34,164 @@ void ClientLogic::initialize(bool &isReconnect) {
 
         // lastly, we parse the me.info for reconnection
         if (!parseInfo())
-            clientStop();
-        return ; // successfully parsed info
+            return false;
+        loadTicket();
+        return true; // successfully parsed info
     }
 
     // CLIENT_INFO doesn't exist.
     // first, we check for transfer.info in case the client isn't registered yet
-    if (!isFileEmptyAndOpen(SERVER_INFO)) {
-        clientStop();
-    }
+    if (!isFileEmptyAndOpen(SERVER_INFO))
+        return false;
 
     // lastly, we parse the transfer.info for registration
-    if (!parseInfo())
-        clientStop();
+    return parseInfo();
 }
 
 /**
- * Register the client with the server
+ * Where a file of the session lies, a relative path is taken from the session's directory.
  */
-bool ClientLogic::registerClient() {
+std::string ClientLogic::inDirectory(const std::string &filePath) const {
+    return (std::filesystem::path(_directory) / filePath).string();
+}
+
+/**
+ * Generate the rsa key on the thread pool, while the first requests are in flight.
+ */
+void ClientLogic::startKeyGeneration() {
+    if (_rsaPrivateWrapper || _pendingRsaKey.valid())
+        return;
+    _pendingRsaKey = ThreadPool::shared().start([]() { return std::make_unique<RSAPrivateWrapper>(); });
+}
+
+/**
+ * The key sent to the server, awaiting its generation on the thread pool if it didn't finish yet.
+ * Rethrows a failed generation, and starts over the next time.
+ */
+awaitable<void> ClientLogic::generateRsaKey() {
+    if (_rsaPrivateWrapper)
+        co_return;
+    startKeyGeneration();
+    ThreadPool::Pending<std::unique_ptr<RSAPrivateWrapper>> pending = std::move(_pendingRsaKey);
+    _rsaPrivateWrapper = co_await pending.get();
+}
+
+/**
+ * Ask the server for its version, the window of file packets it accepts in flight, the cipher mode to use
+ * and the size of the frames its file packets may fill.
+ * Servers that don't know this request are treated as legacy, stop-and-wait servers.
+ */
+awaitable<bool> ClientLogic::requestCapabilitiesAsync() {
+    SRequestCapabilities request(MAX_WINDOW_SIZE, MAX_FRAME_SIZE);
+    SResponseCapabilities response;
+
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // padded frames until the server's version tells they can be exact
+    _server = SServer();
+    _socketHandler->setExactFraming(false);
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
+    {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
+    }
+
+    // Deserialize the response
+    Schema::fromWire(response);
+
+    if(!validateHeader(response.header, SERVER_CAPABILITIES))
+        co_return false;
+
+    _server.version = response.header.version;
+    _server.windowSize = std::clamp<window_t>(response.payload.windowSize, 1, MAX_WINDOW_SIZE);
+    if (_server.version >= CIPHER_MODE_VERSION) {
+        if (!(SUPPORTED_CIPHER_MODES & (1 << response.payload.cipherMode)))
+        {
+            clearLastError();
+            _lastError << "Server picked an unsupported cipher mode (" << (int)response.payload.cipherMode << ")";
+            co_return false;
+        }
+        _server.cipherMode = response.payload.cipherMode;
+    }
+    if (_server.version >= FRAME_SIZE_VERSION)
+        _server.frameSize = std::clamp<csize_t>(response.payload.frameSize, PACKET_SIZE, MAX_FRAME_SIZE);
+    _socketHandler->setExactFraming(_server.version >= EXACT_FRAME_VERSION);
+    co_return true;
+}
+
+/**
+ * Register the client with the server.
+ * Servers of COMBINED_REGISTRATION_VERSION agree on the aes key in the same round trip,
+ * a generic error to that request falls back to registering alone.
+ */
+awaitable<bool> ClientLogic::registerClientAsync() {
+    if (_server.version >= COMBINED_REGISTRATION_VERSION) {
+        bool isUnsupported = false;
+        const bool registered = co_await registerWithAgreementKey(isUnsupported);
+        if (registered || !isUnsupported)
+            co_return _self._keyExchanged;
+    }
+
     SRequestConnection request(_self.userName,REGISTRATION);
     SResponseClientID response;
 
-    // Serialize the request
-    std::vector<uint8_t> serializedRequest(
-            reinterpret_cast<const uint8_t*>(&request),
-            reinterpret_cast<const uint8_t*>(&request) + sizeof(request));
+    // the rsa key is only needed after registering, generate it meanwhile
+    if (_server.version < KEY_AGREEMENT_VERSION)
+        startKeyGeneration();
 
-    // Prepare response vector
-    std::vector<uint8_t> responseData;
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
 
     // Send request and receive response
-    if (!_socketHandler->communicate(serializedRequest, responseData, sizeof(response)))
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
         _lastError << "Failed communicating with server on " << _socketHandler;
-        return false;
+        co_return false;
     }
 
     // Deserialize the response
-    std::memcpy(&response, responseData.data(), sizeof(SResponseClientID));
+    Schema::fromWire(response);
 
     if(!validateHeader(response.header, REGISTRATION_SUCCEEDED))
-        return false;
+        co_return false;
 
     // store received client's ID
     std::copy_n(response.payload.begin(),CLIENT_ID_SIZE, _self.id.begin());
 
-    return true;
+    co_return true;
 }
 
 /**
- * Send the the public key to the server
+ * Send the the public key to the server.
+ * Servers of KEY_AGREEMENT_VERSION agree on the aes key with an X25519 key instead.
  */
-bool ClientLogic::sendPublicKey() {
+awaitable<bool> ClientLogic::sendPublicKeyAsync() {
+    if (_server.version >= KEY_AGREEMENT_VERSION)
+        co_return co_await sendAgreementKey();
+
     SRequestSendPublicKey request(_self.id, _self.userName);
     SResponseAESKey response;
 
     // create a public key
     std::string publicKey;
     try {
-        publicKey = _rsaPrivateWrapper.getPublicKey();
+        co_await generateRsaKey();
+        publicKey = _rsaPrivateWrapper->getPublicKey();
     } catch (CryptoPP::Exception& e){
         clearLastError();
         _lastError << "Exception occurred while generating public key";
-        return false;
+        co_return false;
     }
 
     if (publicKey.size() != RSA_KEY_SIZE) {
         clearLastError();
         _lastError << "Invalid public key length!";
-        return false;
+        co_return false;
     }
 
     // store the private key in the request
@@ -97,38 +200,35 @@ bool ClientLogic::sendPublicKey() {
     // create a private key with base 64 encoded
     std::string privateKey;
     try {
-        privateKey = _rsaPrivateWrapper.getPrivateKey();
+        privateKey = _rsaPrivateWrapper->getPrivateKey();
     } catch (CryptoPP::Exception& e){
         clearLastError();
         _lastError << "Exception occurred while generating private key";
-        return false;
+        co_return false;
     }
     _self.privateKey = Base64Wrapper::encode(privateKey);
 
     // Serialize the request
-    std::vector<uint8_t> serializedRequest = std::vector<uint8_t>(
-            reinterpret_cast<const uint8_t *>(&request),
-            reinterpret_cast<const uint8_t *>(&request) + sizeof(request));
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
 
     // send request and receive response
-    std::vector<uint8_t> responseData;
-
-    if (!_socketHandler->communicate(serializedRequest, responseData, sizeof(response)))
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
         _lastError << "Failed communicating with server on " << _socketHandler;
-        return false;
+        co_return false;
     }
 
     // Deserialize the response
-    std::memcpy(&response, responseData.data(), sizeof(SResponseAESKey));
+    Schema::fromWire(response);
 
     if(!validateHeader(response.header, RECEIVED_PUBLIC_KEY_AND_SENDING_AES))
-        return false;
+        co_return false;
 
     try {
         // Generate decrypted key from response's aes key using rsa decryption with our private key
-        std::string decryptedAESKey = _rsaPrivateWrapper.decrypt(
+        std::string decryptedAESKey = _rsaPrivateWrapper->decrypt(
                 reinterpret_cast<const char *>(response.payload.serverAESKey.data()),
                 DECRYPTED_AES_KEY_SIZE);
 
@@ -137,56 +237,157 @@ bool ClientLogic::sendPublicKey() {
     } catch(std::length_error& e){
         clearLastError();
         _lastError << "AES key length error: " << e.what();
-        return false;
+        co_return false;
     } catch(CryptoPP::Exception& e ){
         clearLastError();
         _lastError << "Exception occurred while decrypting key: " << e.what();
-        return false;
+        co_return false;
     }
 
     // we store the username, UUID (that we have from the registration),
     // and the private key into the CLIENT_INFO and KEY_INFO files.
-    return storeClientInfo();
+    co_return storeClientInfo();
+}
+
+/**
+ * Register with an X25519 public key, the reply carries both the client's id and the server's half of the agreement.
+ */
+awaitable<bool> ClientLogic::registerWithAgreementKey(bool &isUnsupported) {
+    X25519Wrapper agreementKey;
+    SRequestSendAgreementKey request(_self.userName, agreementKey.getPublicKey());
+    SResponseAgreedKey response;
+
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // send request and receive response
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
+    {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
+    }
+
+    // Deserialize the response, the agreement is checked against the id it assigned
+    Schema::fromWire(response);
+    isUnsupported = response.header.code == GENERIC_ERROR;
+    _self.id = response.payload.clientId;
+    if (!deriveAgreedKey(response, agreementKey)) {
+        _self.id = {};
+        co_return false;
+    }
+
+    _self.privateKey = Base64Wrapper::encode(agreementKey.getPrivateKey());
+    _self._keyExchanged = storeClientInfo();
+    co_return _self._keyExchanged;
+}
+
+/**
+ * Send an X25519 public key to the server, and derive the aes key from its reply
+ */
+awaitable<bool> ClientLogic::sendAgreementKey() {
+    X25519Wrapper agreementKey;
+    SRequestSendAgreementKey request(_self.id, _self.userName, agreementKey.getPublicKey());
+    SResponseAgreedKey response;
+
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // send request and receive response
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
+    {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
+    }
+
+    // Deserialize the response
+    Schema::fromWire(response);
+    if (!deriveAgreedKey(response, agreementKey))
+        co_return false;
+
+    // the private key is kept for reconnecting, in place of the rsa one
+    _self.privateKey = Base64Wrapper::encode(agreementKey.getPrivateKey());
+    co_return storeClientInfo();
+}
+
+/**
+ * Derive the aes key from the server's reply to an X25519 public key, ours or the one registered.
+ */
+bool ClientLogic::deriveAgreedKey(const SResponseAgreedKey &response, const X25519Wrapper &agreementKey) {
+    if(!validateHeader(response.header, AGREED_ON_AES_KEY))
+        return false;
+
+    if(response.payload.clientId != _self.id)
+    {
+        clearLastError();
+        _lastError << "Received a response with client id not the same as it was when registered";
+        return false;
+    }
+
+    try {
+        _self.aesKey = agreementKey.deriveKey(response.payload.serverPublicKey, response.payload.salt);
+    } catch(CryptoPP::Exception& e ){
+        clearLastError();
+        _lastError << "Exception occurred while agreeing on key: " << e.what();
+        return false;
+    }
+    return true;
 }
 
 /**
  * Reconnect to the server, we dont need to exchange keys this time
  */
-bool ClientLogic::reconnectClient() {
+awaitable<bool> ClientLogic::reconnectClientAsync() {
     SRequestConnection request(_self.id, _self.userName, RECONNECTION);
     SResponseAESKey response;
 
     // Serialize the request
-    std::vector<uint8_t> serializedRequest = std::vector<uint8_t>(
-            reinterpret_cast<const uint8_t *>(&request),
-            reinterpret_cast<const uint8_t *>(&request) + sizeof(request));
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
 
     // send request and receive response's header
-    std::vector<uint8_t> responseData;
-    if (!_socketHandler->communicate(serializedRequest, responseData, sizeof(response)))
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
         _lastError << "Failed communicating with server on " << _socketHandler;
-        return false;
+        co_return false;
+    }
+
+    // a client that registered by key agreement has an X25519 key, the server agrees on a new aes key with it.
+    // Its reply is shorter, it's read from the bytes received into the response
+    const std::string registeredKey = Base64Wrapper::decode(_self.privateKey);
+    if (registeredKey.size() == X25519Wrapper::KEYSIZE) {
+        SResponseAgreedKey agreed;
+        Schema::deserialize(Schema::image(response), agreed);
+        try {
+            co_return deriveAgreedKey(agreed, X25519Wrapper(registeredKey));
+        } catch(CryptoPP::Exception& e ){
+            clearLastError();
+            _lastError << "Exception occurred while loading key: " << e.what();
+            co_return false;
+        }
     }
 
     // Deserialize the response
-    std::memcpy(&response, responseData.data(), sizeof(SResponseAESKey));
+    Schema::fromWire(response);
 
     if(!validateHeader(response.header, APPROVED_REQUEST_TO_RECONNECT_SENDING_AES)) {
-        return false;
+        co_return false;
     }
 
     if(response.payload.clientId != _self.id)
     {
         clearLastError();
         _lastError << "Received a response with client id not the same as it was when registered";
-        return false;
+        co_return false;
     }
     try {
         // Generate a rsa key from the response's aes key using rsa decryption,
         // with the private key we have from the first run after we decode it from base 64
-        RSAPrivateWrapper registeredRsaKey(Base64Wrapper::decode(_self.privateKey));
+        RSAPrivateWrapper registeredRsaKey(registeredKey);
 
         // Decrypt the aes key
         std::string decryptedAESKey = registeredRsaKey.decrypt(
@@ -198,121 +399,324 @@ bool ClientLogic::reconnectClient() {
     } catch(std::length_error& e){
         clearLastError();
         _lastError << "AES key length error: " << e.what();
-        return false;
+        co_return false;
     } catch(CryptoPP::Exception& e ){
         clearLastError();
         _lastError << "Exception occurred while decrypting key: " << e.what();
-        return false;
+        co_return false;
     }
-    return true;
+    co_return true;
 }
 
 /**
- * Send a file to the server, its encrypted with the aes key the server has sent to us.
+ * Resume the previous session with its ticket, skipping the key exchange of a reconnection.
+ * The ticket is dropped if the server doesn't accept it, the caller reconnects instead.
  */
-bool ClientLogic::sendEncryptedFileAndCorrespondedCRC(bool &isInvalidCRC) {
-    // get the file name from our std::array into a std::string
-    std::string fileName(_self.fileName.begin(), _self.fileName.end());
+awaitable<bool> ClientLogic::resumeSessionAsync() {
+    const auto now = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    if (_server.version < RESUMPTION_VERSION || _resumption.expiry <= now)
+        co_return false;
+
+    ResumptionNonce nonce;
+    CryptoPP::AutoSeededRandomPool rng;
+    rng.GenerateBlock(nonce.data(), nonce.size());
+    SRequestResumption request(_self.id, _self.userName, _resumption.ticket, nonce);
+    SResponseSessionTicket response;
+    const SResumption resumption = _resumption;
+    _resumption = SResumption();  // a ticket is used once
 
-    // get the crc from the given code in unit 7, and the file content, match to our flow
-    std::string messageContent;
-    CRC crc;
-    if(!Chksum::readFile(fileName, messageContent, crc, _self.fileSize))
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // send request and receive response
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
-        _lastError << "Was unable to read from file: " << fileName;
-        return false;
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
     }
 
-    // Handle for large files
-    if(messageContent.length() > std::numeric_limits<uint16_t>::max())
+    // Deserialize the response
+    Schema::fromWire(response);
+
+    if (!validateHeader(response.header, SESSION_TICKET) || response.payload.clientId != _self.id) {
+        (void)storeTicket(SResponseSessionTicket());  // forget the rejected ticket
+        co_return false;
+    }
+
+    // the session's key is derived from the ticket's secret, the reply's ticket resumes the next one
+    _self.aesKey = AESWrapper::deriveKey(resumption.secret, nonce.data(), nonce.size(), RESUMED_KEY_INFO);
+    co_return storeTicket(response);
+}
+
+/**
+ * Ask for a ticket to resume the session with on the next run. The session works without one.
+ */
+awaitable<bool> ClientLogic::requestTicketAsync() {
+    if (_server.version < RESUMPTION_VERSION)
+        co_return false;
+
+    SRequestTicket request(_self.id);
+    SResponseSessionTicket response;
+
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // send request and receive response
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
-        _lastError << "content of the file (" << fileName << ") is larger than ("
-                   <<  std::numeric_limits<uint16_t>::max() << ")";
-        return false;
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
     }
 
-    // Generate an aes key and encrypt file's content
-    AESWrapper aesKey = AESWrapper(_self.aesKey);
-    messageContent = aesKey.encrypt(messageContent);
+    // Deserialize the response
+    Schema::fromWire(response);
 
-    // Calculate how many chunks fits in the total message content
-    auto totalPackets = (totalMessageCount)((messageContent.length() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    if (!validateHeader(response.header, SESSION_TICKET))
+        co_return false;
 
-    // initialize a request and a response
-    SRequestSendFile request(_self.id, _self.fileName, (DecryptedContentSize)_self.fileSize,
-                             (EncryptedContentSize)messageContent.length(), totalPackets);
-    SResponseReceivedValidFileWithCRC response;
+    if(response.payload.clientId != _self.id)
+    {
+        clearLastError();
+        _lastError << "Received a response with client id not the same as it was when registered";
+        co_return false;
+    }
+    co_return storeTicket(response);
+}
 
+/**
+ * Send a file to the server, its encrypted with the aes key the server has sent to us.
+ * Servers of LARGE_FILE_VERSION take 64-bit sizes and packet numbers, older ones up to 64 KiB files.
+ * Servers of CIPHER_MODE_VERSION are also told the negotiated cipher mode.
+ * Servers of COMPACT_FILE_VERSION are told all of that once, when the transfer is opened.
+ */
+awaitable<bool> ClientLogic::sendEncryptedFileAndCorrespondedCRCAsync(bool &isInvalidCRC) {
+    if (_server.version >= COMPACT_FILE_VERSION)
+        co_return co_await sendFile<SRequestSendCompactFile, SResponseLargePacketReceived,
+                                    SResponseReceivedValidLargeFile>(isInvalidCRC);
+    if (_server.version >= CIPHER_MODE_VERSION)
+        co_return co_await sendFile<SRequestSendCipherFile, SResponseLargePacketReceived,
+                                    SResponseReceivedValidLargeFile>(isInvalidCRC);
+    if (_server.version >= LARGE_FILE_VERSION)
+        co_return co_await sendFile<SRequestSendLargeFile, SResponseLargePacketReceived,
+                                    SResponseReceivedValidLargeFile>(isInvalidCRC);
 
-    
-    // send request and receive response for each communication with the server,
-    // validating received a message.
-    csize_t serializedSize;
-    std::vector<uint8_t> serializedRequest;
-    std::vector<uint8_t> responseData;
+    // Handle for large files
+    if(_self.fileSize > std::numeric_limits<uint16_t>::max())
+    {
+        clearLastError();
+        _lastError << "content of the file (" << _self.fileName.data() << ") is larger than ("
+                   <<  std::numeric_limits<uint16_t>::max() << "), the server doesn't support large files";
+        co_return false;
+    }
+    co_return co_await sendFile<SRequestSendFile, SResponsePacketReceived,
+                                SResponseReceivedValidFileWithCRC>(isInvalidCRC);
+}
 
-    // iterate through each packet by sending it to the server.
-    while(request.payload.packets.packetNumber <= request.payload.packets.totalPackets) {
-        // Calculate the offset in the request for the current packet
-        DecryptedContentSize offset = (request.payload.packets.packetNumber - 1) * CHUNK_SIZE;
+/**
+ * Send the file in packets of the given request layout, acknowledged with Ack and answered with Response.
+ */
+template <typename Request, typename Ack, typename Response>
+awaitable<bool> ClientLogic::sendFile(bool &isInvalidCRC) {
+    typedef typename Request::PacketNumber PacketNumber;
 
-        // get the sub message
-        csize_t subMessageSize = std::min(request.payload.contentSize - offset, CHUNK_SIZE);
-        std::string subMessage = messageContent.substr(offset, subMessageSize);
+    // get the file name from our std::array into a std::string
+    std::string fileName(_self.fileName.begin(), _self.fileName.end());
 
-        // save the current encrypted chunk
-        request.payload.messageContent.fill(0); // reset previous chunks
-        std::copy_n(subMessage.begin(), subMessageSize, request.payload.messageContent.begin());
-        csize_t payloadSize = request.setPayloadSize(subMessageSize);
+    // The file is streamed: read, checksummed and encrypted a chunk at a time, just ahead of the
+    // packet that carries it. Only about READ_SIZE of it is held in memory, whatever the file's size.
+    // Mapped when it's local, a network file system would stall on page faults so it's read ahead instead
+    FileHandle file;
+    const std::string filePath = inDirectory(fileName.c_str());
+    const bool opened = FileHandle::isNetworkFileSystem(filePath) ?
+            file.openReadAhead(filePath, _self.fileSize >= DIRECT_IO_MIN_SIZE) :
+            file.openMapped(filePath);
+    if(!opened && !file.open(filePath))
+    {
+        clearLastError();
+        _lastError << "Was unable to read from file: " << fileName;
+        co_return false;
+    }
 
-        // Calculate the clean size of the current chunk
-        serializedSize = sizeof(SRequestHeader) + payloadSize;
+    // Only layouts that carry a cipher mode, or open the transfer with one, can use another mode than CBC
+    constexpr bool compact = requires(Request r) { r.payload.transferId; };
+    constexpr csize_t prefixSize = sizeof(Request) - Request::CHUNK;   // the request before its content
+    cipher_mode_t cipherMode = CIPHER_CBC;
+    if constexpr (compact || requires(Request r) { r.payload.cipherMode; })
+        cipherMode = _server.cipherMode;
+
+    // the compact layout's packets fill the negotiated frame, the others a PACKET_SIZE one
+    const csize_t chunkSize = compact ? _server.frameSize - prefixSize : Request::CHUNK;
+
+    // The session's key encrypts every file and every attempt of it, and GCM's nonces only tell packets apart
+    // by a short random salt and their number. Servers of TRANSFER_KEY_VERSION take an open transfer's content
+    // under a key of its own, derived from a salt sent when it's opened.
+    AESKey contentKey = _self.aesKey;
+    KeySalt transferSalt = {};
+    if (compact && _server.version >= TRANSFER_KEY_VERSION) {
+        CryptoPP::AutoSeededRandomPool rng;
+        rng.GenerateBlock(transferSalt.data(), transferSalt.size());
+        contentKey = AESWrapper::deriveKey(_self.aesKey, transferSalt.data(), transferSalt.size(), TRANSFER_KEY_INFO);
+    }
+    std::unique_ptr<AESWrapper::StreamEncryptor> encryptor;
+    if (cipherMode == CIPHER_CTR)
+        encryptor = std::make_unique<AESWrapper::CtrEncryptor>(contentKey, ThreadPool::shared());
+    else if (cipherMode == CIPHER_GCM)
+        encryptor = std::make_unique<AESWrapper::GcmEncryptor>(contentKey, ThreadPool::shared(), chunkSize);
+    else
+        encryptor = std::make_unique<AESWrapper::Encryptor>(contentKey);
+    Chksum chksum;
+    SCipherBuffer pending(READ_SIZE + chunkSize + 2 * AESWrapper::BLOCK_SIZE);    // encrypted content not sent yet
+    pending.commit(encryptor->start(pending.reserve(AESWrapper::BLOCK_SIZE)));
 
-        // Serialize the current state of the request
-        serializedRequest.assign(reinterpret_cast<const uint8_t *>(&request),
-                                 reinterpret_cast<const uint8_t *>(&request) + serializedSize);
+    // Calculate how many chunks fits in the total message content
+    const LargeContentSize encryptedSize = encryptor->cipherSize(_self.fileSize);
+    const auto totalPackets = (PacketNumber)((encryptedSize + chunkSize - 1) / chunkSize);
+
+    // initialize a request and a response, the compact layout's file is described when opening the transfer
+    std::unique_ptr<Request> request;
+    if constexpr (compact) {
+        transfer_id_t transferId;
+        const bool transferOpened = co_await openTransfer(encryptedSize, totalPackets, cipherMode,
+                                                          prefixSize + chunkSize, transferSalt, transferId);
+        if (!transferOpened)
+            co_return false;
+        request = std::make_unique<Request>(_self.id, transferId);
+    }
+    else
+        request = std::make_unique<Request>(_self.id, _self.fileName, _self.fileSize, encryptedSize, totalPackets);
+    if constexpr (requires(Request r) { r.payload.cipherMode; })
+        request->payload.cipherMode = cipherMode;
+    Response response;
+
+    // keep up to a window of packets in flight when the server advertised one,
+    // otherwise send each packet and wait for its reply.
+    bool pipelined = false;
+    if (_server.windowSize > 1)
+        pipelined = co_await _socketHandler->openSessionAsync();
+    const window_t window = pipelined ? _server.windowSize : 1;
+
+    // Servers of STRIPED_VERSION take an open transfer's packets over several connections, in any order.
+    // Each packet is serialized whole, the connections send it while the next ones are encrypted.
+    if constexpr (compact) {
+        if (pipelined && _server.version >= STRIPED_VERSION) {
+            auto produce = [&](const PacketNumber packetNumber, std::vector<uint8_t> &frame) -> awaitable<bool> {
+                const LargeContentSize offset = (packetNumber - 1) * chunkSize;
+                const auto subMessageSize = (csize_t)std::min<LargeContentSize>(encryptedSize - offset, chunkSize);
+                const bool encrypted = co_await encryptFileUntil(file, *encryptor, chksum, pending, subMessageSize);
+                if (!encrypted)
+                    co_return false;
+                request->payload.packets.packetNumber = packetNumber;
+                request->setPayloadSize(subMessageSize);
+                frame.resize(prefixSize + subMessageSize);
+                Schema::toWire(*request, frame.data(), prefixSize);
+                std::copy_n(pending.data(), subMessageSize, frame.data() + prefixSize);
+                pending.consume(subMessageSize);
+                request->payload.packets.packetNumber++;  // past the last packet once they were all produced
+                co_return true;
+            };
+
+            // the connections' coroutines share the striping's state, a strand keeps them off each other
+            const auto executor = co_await boost::asio::this_coro::executor;
+            const bool striped = co_await boost::asio::co_spawn(boost::asio::make_strand(executor),
+                                                                sendStriped(produce, totalPackets, response),
+                                                                use_awaitable);
+            if (!striped)
+                co_return false;
+        }
+    }
+
+    std::array<uint8_t, prefixSize> serializedHead;    // the request's fields, its content is sent from pending
+    std::array<uint8_t, std::max(sizeof(Ack), sizeof(Response))> responseData;  // a packet's reply, either layout
+    std::deque<PacketNumber> inFlight;  // in the order their replies arrive
+
+    // A sealed packet the server rejected is sent again as it was, the rest of the file goes on
+    const bool authenticated = cipherMode == CIPHER_GCM;
+    std::map<PacketNumber, std::vector<uint8_t>> unacknowledged;
+    std::map<PacketNumber, csize_t> rejections;
+
+    while (!inFlight.empty() || request->payload.packets.packetNumber <= totalPackets) {
+        // iterate through the packets that fit in the window by sending them to the server.
+        while (request->payload.packets.packetNumber <= totalPackets && inFlight.size() < window) {
+            // Calculate the offset in the request for the current packet
+            LargeContentSize offset = (request->payload.packets.packetNumber - 1) * chunkSize;
+
+            // get the sub message
+            csize_t subMessageSize = (csize_t)std::min<LargeContentSize>(encryptedSize - offset, chunkSize);
+            const bool encrypted = co_await encryptFileUntil(file, *encryptor, chksum, pending, subMessageSize);
+            if (!encrypted)
+                co_return false;
+            request->setPayloadSize(subMessageSize);
+
+            // Serialize the request's fields, the current encrypted chunk follows them on the wire as it lies
+            // in pending. It may be longer than the request's content array when the frame is
+            Schema::toWire(*request, serializedHead.data(), prefixSize);
+            const SFrame packet(serializedHead, std::span<const uint8_t>(pending.data(), subMessageSize));
+            const bool transmitted = co_await transmitPacket(packet, pipelined, responseData);
+            if (!transmitted)
+                co_return false;
+            inFlight.push_back(request->payload.packets.packetNumber);
+            if (authenticated) {
+                // kept whole until acknowledged, a rejected packet is sent again
+                std::vector<uint8_t> &copy = unacknowledged[request->payload.packets.packetNumber];
+                copy.assign(serializedHead.begin(), serializedHead.end());
+                copy.insert(copy.end(), packet.body.begin(), packet.body.end());
+            }
+            pending.consume(subMessageSize);
+
+            // Increment the packet number for the next iteration
+            request->payload.packets.packetNumber++;
+            if (!pipelined)
+                break;
+        }
 
-        // send a serialized request and received a thank-you message, until the last packet sent
-        if (!_socketHandler->communicate(serializedRequest, responseData, sizeof(response))) {
+        // receive the reply of the oldest packet in flight
+        bool received = true;
+        if (pipelined)
+            received = co_await _socketHandler->receiveAsync(responseData);
+        if (!received) {
             clearLastError();
             _lastError << "Failed communicating with server on " << _socketHandler;
-            return false;
+            co_return false;
         }
 
-        // Deserialize the response
-        std::memcpy(&response, responseData.data(), sizeof(response));
-
-        // Should be response of a received message
-        if (request.payload.packets.packetNumber < request.payload.packets.totalPackets) {
-            if (!validateHeader(response.header, APPROVED_GETTING_MESSAGE_THANKS)) {
-                return false;
-            }
-        }
-        else {
-            // Handle the last packet received from the server
-            if (!validateHeader(response.header, FILE_RECEIVED_PROPERLY_WITH_CRC)) {
-                return false;
-            }
+        // the reply of the packet that completes the file carries the CRC
+        const PacketNumber packetNumber = inFlight.front();
+        inFlight.pop_front();
+        const bool completes = inFlight.empty() && request->payload.packets.packetNumber > totalPackets;
+        bool rejected = false;
+        if (!validatePacketResponse<Request, Ack, Response>(responseData, packetNumber, completes, response, rejected)) {
+            if (pipelined)
+                _socketHandler->close();  // drop the replies still in flight.
+            co_return false;
         }
 
-        if(response.payload.clientId != _self.id)
-        {
+        if (!rejected) {
+            unacknowledged.erase(packetNumber);
+            continue;
+        }
+        if (!authenticated || ++rejections[packetNumber] > MAX_RETRIES) {
             clearLastError();
-            _lastError << "Received a response with client id not the same as it was when sent file";
-            return false;
+            _lastError << "Server rejected packet " << packetNumber << (authenticated ? " too many times" : "");
+            if (pipelined)
+                _socketHandler->close();
+            co_return false;
         }
-
-        // Increment the packet number for the next iteration
-        request.payload.packets.packetNumber++;
+        const bool transmitted = co_await transmitPacket(unacknowledged[packetNumber], pipelined, responseData);
+        if (!transmitted)
+            co_return false;
+        inFlight.push_back(packetNumber);
     }
 
-    if(response.payload.contentSize != request.payload.contentSize)
+    if(response.payload.contentSize != encryptedSize)
     {
         clearLastError();
         _lastError << "Received a response with content size not the same as it was when sent file";
-        return false;
+        co_return false;
     }
 
     if(response.payload.fileName != _self.fileName)
@@ -320,53 +724,418 @@ bool ClientLogic::sendEncryptedFileAndCorrespondedCRC(bool &isInvalidCRC) {
         clearLastError();
         _lastError << "Received a response with file name"  << std::endl
                    <<"    Not the same as it was when sent file (" << fileName << ")";
-        return false;
+        co_return false;
     }
 
     // now we only need to validate crc in the next protocol operations
-    if(response.payload.cksum != crc)
+    if(response.payload.cksum != chksum.finalize())
         isInvalidCRC = true;
 
+    co_return true;
+}
+
+/**
+ * Send the packets of an open transfer over the session's connection, and over more connections while each one
+ * added raises the throughput by STRIPE_MIN_GAIN. The one that didn't takes no more packets.
+ * When every connection failed, a new one sends the packets they left unacknowledged.
+ * Runs on a strand, with the coroutines of the connections.
+ */
+awaitable<bool> ClientLogic::sendStriped(SStriping::Produce produce, const SStriping::PacketNumber totalPackets,
+                                         SResponseReceivedValidLargeFile &response) {
+    const auto executor = co_await boost::asio::this_coro::executor;
+    SStriping striping(executor, std::move(produce), totalPackets, _server.windowSize);
+    std::vector<std::unique_ptr<CSocketHandler>> siblings;
+    auto start = [&](CSocketHandler &socket, const size_t index) {
+        striping.running++;
+        boost::asio::co_spawn(executor, sendStripe(striping, socket, index), [&](std::exception_ptr error) {
+            try {
+                if (error)
+                    std::rethrow_exception(error);
+            } catch (const std::exception &e) {
+                clearLastError();
+                _lastError << "Exception occurred while sending the file: " << e.what();
+                striping.failed = true;
+            }
+            if (striping.failed)
+                striping.idle.cancel();
+            if (--striping.running == 0)
+                striping.wakeup.cancel();
+        });
+    };
+    start(*_socketHandler, 0);
+
+    double bestRate = 0;
+    bool settled = false;
+    auto since = std::chrono::steady_clock::now();
+    uint64_t acknowledgedSince = 0;
+    int reopened = 0;
+    while (striping.running > 0 || (!striping.finished() && reopened < MAX_RETRIES)) {
+        if (striping.running == 0) {
+            // every connection failed, a new one takes the packets they left unacknowledged
+            reopened++;
+            std::unique_ptr<CSocketHandler> sibling = _socketHandler->sibling();
+            const bool opened = co_await sibling->openSessionAsync();
+            if (opened) {
+                siblings.push_back(std::move(sibling));
+                start(*siblings.back(), 0);
+            }
+            continue;
+        }
+
+        boost::system::error_code errorCode;
+        striping.wakeup.expires_after(STRIPE_PROBE_INTERVAL);
+        co_await striping.wakeup.async_wait(redirect_error(use_awaitable, errorCode));
+        if (settled || striping.running == 0 || striping.failed || striping.acknowledged == acknowledgedSince)
+            continue;
+
+        // the bytes acknowledged per second since the last connection was added, or the last probe
+        const auto now = std::chrono::steady_clock::now();
+        const double rate = (double)(striping.acknowledged - acknowledgedSince) /
+                            std::chrono::duration<double>(now - since).count();
+        since = now;
+        acknowledgedSince = striping.acknowledged;
+        if (rate <= bestRate * STRIPE_MIN_GAIN) {
+            if (striping.streams > 1)
+                striping.streams--;  // the last connection added didn't pay off, it drains what it has
+            settled = true;
+            continue;
+        }
+        bestRate = rate;
+        if (striping.streams >= MAX_STREAMS || striping.nextPacket > striping.totalPackets)
+            continue;
+
+        // one more connection, it shares the window with the others
+        std::unique_ptr<CSocketHandler> sibling = _socketHandler->sibling();
+        const bool opened = co_await sibling->openSessionAsync();
+        if (!opened) {
+            settled = true;
+            continue;
+        }
+        siblings.push_back(std::move(sibling));
+        start(*siblings.back(), striping.streams++);
+        since = std::chrono::steady_clock::now();
+        acknowledgedSince = striping.acknowledged;
+    }
+
+    if (striping.failed)
+        co_return false;
+    if (!striping.completed) {
+        clearLastError();
+        _lastError << "Connections failed with " << striping.unacknowledged.size() << " packets unacknowledged";
+        co_return false;
+    }
+    response = striping.response;
+    co_return true;
+}
+
+/**
+ * Send packets of a striped file over one connection, with up to its share of the window in flight.
+ * Its replies arrive in the order its packets were sent, any packet's reply may be the one carrying the CRC.
+ * A connection that fails hands the packets it had in flight to the others, so one with nothing left to send
+ * stays until every packet is acknowledged.
+ */
+awaitable<void> ClientLogic::sendStripe(SStriping &striping, CSocketHandler &socket, const size_t index) {
+    typedef SStriping::PacketNumber PacketNumber;
+    std::array<uint8_t, std::max(sizeof(SResponseLargePacketReceived), sizeof(SResponseReceivedValidLargeFile))>
+            responseData;
+    std::deque<PacketNumber> inFlight;
+    bool healthy = true;
+
+    while (healthy && !striping.failed) {
+        // a connection past the ones taking packets only takes those another connection left behind
+        const size_t share = std::max<size_t>(1, striping.window / striping.streams);
+        while (inFlight.size() < share) {
+            PacketNumber packetNumber;
+            if (!striping.orphans.empty()) {
+                packetNumber = striping.orphans.front();
+                striping.orphans.pop_front();
+            }
+            else if (!striping.producing && index < striping.streams && striping.nextPacket <= striping.totalPackets) {
+                // packets are produced in order, by one connection at a time
+                packetNumber = striping.nextPacket++;
+                striping.producing = true;
+                const bool produced = co_await striping.produce(packetNumber, striping.unacknowledged[packetNumber]);
+                striping.producing = false;
+                striping.idle.cancel();
+                if (!produced) {
+                    striping.failed = true;
+                    break;
+                }
+            }
+            else
+                break;
+            inFlight.push_back(packetNumber);
+            healthy = co_await socket.sendAsync(striping.unacknowledged[packetNumber]);
+            if (!healthy)
+                break;
+        }
+        if (!healthy || striping.failed)
+            break;
+        if (inFlight.empty()) {
+            if (striping.finished())
+                break;
+            boost::system::error_code errorCode;
+            co_await striping.idle.async_wait(redirect_error(use_awaitable, errorCode));
+            continue;
+        }
+
+        healthy = co_await socket.receiveAsync(responseData);
+        if (!healthy)
+            break;
+        const PacketNumber packetNumber = inFlight.front();
+        inFlight.pop_front();
+
+        SResponseHeader header;
+        Schema::deserialize(responseData, header);
+        const bool completes = header.code == FILE_RECEIVED_PROPERLY_WITH_CRC;
+        bool rejected = false;
+        if (!validatePacketResponse<SRequestSendCompactFile, SResponseLargePacketReceived,
+                                    SResponseReceivedValidLargeFile>(responseData, packetNumber, completes,
+                                                                     striping.response, rejected)) {
+            striping.failed = true;
+            break;
+        }
+        if (rejected) {
+            // a sealed packet that failed authentication is sent again as it was
+            if (++striping.rejections[packetNumber] > MAX_RETRIES) {
+                clearLastError();
+                _lastError << "Server rejected packet " << packetNumber << " too many times";
+                striping.failed = true;
+                break;
+            }
+            inFlight.push_back(packetNumber);
+            healthy = co_await socket.sendAsync(striping.unacknowledged[packetNumber]);
+            continue;
+        }
+        striping.acknowledged += striping.unacknowledged[packetNumber].size();
+        striping.unacknowledged.erase(packetNumber);
+        striping.completed = striping.completed || completes;
+        if (striping.finished())
+            striping.idle.cancel();
+    }
+
+    if (!healthy) {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << &socket;
+        striping.orphans.insert(striping.orphans.end(), inFlight.begin(), inFlight.end());
+        striping.idle.cancel();
+    }
+    if (!healthy || striping.failed)
+        socket.close();  // drop the replies still in flight
+}
+
+/**
+ * Send a serialized file packet, without waiting for its reply when pipelined.
+ * Otherwise its reply is received into responseData.
+ */
+awaitable<bool> ClientLogic::transmitPacket(SFrame packet, bool pipelined,
+                                            std::span<uint8_t> responseData) {
+    bool sent;
+    if (pipelined)
+        sent = co_await _socketHandler->sendAsync(packet);
+    else
+        sent = co_await _socketHandler->communicateAsync(packet, responseData);
+    if (!sent) {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << _socketHandler;
+    }
+    co_return sent;
+}
+
+/**
+ * Describe the file to send to the server, which answers with the id its packets are sent with.
+ * Servers of TRANSFER_KEY_VERSION derive the transfer's key from its salt.
+ */
+awaitable<bool> ClientLogic::openTransfer(const LargeContentSize encryptedSize,
+                                          const LargeMessageNum totalPackets, const cipher_mode_t cipherMode,
+                                          const csize_t frameSize, const KeySalt &salt, transfer_id_t &transferId) {
+    SRequestOpenTransfer request(_self.id, _self.fileName, _self.fileSize, encryptedSize, totalPackets, cipherMode,
+                                 frameSize, salt);
+    SResponseTransferOpened response;
+
+    // Serialize the request
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
+
+    // send request and receive response
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
+    {
+        clearLastError();
+        _lastError << "Failed communicating with server on " << _socketHandler;
+        co_return false;
+    }
+
+    // Deserialize the response
+    Schema::fromWire(response);
+
+    if (!validateHeader(response.header, TRANSFER_OPENED))
+        co_return false;
+
+    if(response.payload.clientId != _self.id)
+    {
+        clearLastError();
+        _lastError << "Received a response with client id not the same as it was when registered";
+        co_return false;
+    }
+    transferId = response.payload.transferId;
+    co_return true;
+}
+
+/**
+ * Validate the reply of a single file packet. Every packet but the one completing the file is acknowledged,
+ * with its packet number by servers that support a window. The completing one is answered with the CRC.
+ * A sealed packet that failed authentication is rejected instead, with its packet number.
+ */
+template <typename Request, typename Ack, typename Response>
+bool ClientLogic::validatePacketResponse(const std::span<const uint8_t> responseData,
+                                         const typename Request::PacketNumber packetNumber, const bool completes,
+                                         Response &response, bool &rejected) {
+    SResponseHeader header;
+    Schema::deserialize(responseData, header);
+    rejected = header.code == PACKET_REJECTED;
+
+    Uuid clientId;
+    if (rejected || (!completes && _server.version >= WINDOWED_ACK_VERSION)) {
+        // Deserialize the acknowledgement
+        Ack ack;
+        Schema::deserialize(responseData, ack);
+
+        if (!validateHeader(ack.header, rejected ? PACKET_REJECTED : APPROVED_GETTING_PACKET_THANKS))
+            return false;
+
+        if (ack.payload.packetNumber != packetNumber)
+        {
+            clearLastError();
+            _lastError << "Received an acknowledgement of packet " << ack.payload.packetNumber
+                       << " while expecting packet " << packetNumber;
+            return false;
+        }
+        clientId = ack.payload.clientId;
+    }
+    else {
+        // Deserialize the response
+        Schema::deserialize(responseData, response);
+
+        // Should be response of a received message, or the last packet received by the server
+        const EResponseCode expectedCode = completes ? FILE_RECEIVED_PROPERLY_WITH_CRC : APPROVED_GETTING_MESSAGE_THANKS;
+        if (!validateHeader(response.header, expectedCode))
+            return false;
+        clientId = response.payload.clientId;
+    }
+
+    if(clientId != _self.id)
+    {
+        clearLastError();
+        _lastError << "Received a response with client id not the same as it was when sent file";
+        return false;
+    }
     return true;
 }
 
+/**
+ * Room to write length more bytes at the end, what wasn't consumed yet is moved to the front if needed.
+ */
+uint8_t *ClientLogic::SCipherBuffer::reserve(const size_t length) {
+    if (end + length > buffer.size()) {
+        std::memmove(buffer.data(), buffer.data() + start, size());
+        end -= start;
+        start = 0;
+        if (end + length > buffer.size())
+            buffer.resize(end + length);
+    }
+    return buffer.data() + end;
+}
+
+/**
+ * Read, checksum and encrypt the file until at least needed bytes of encrypted content are pending.
+ */
+awaitable<bool> ClientLogic::encryptFileUntil(FileHandle &file, AESWrapper::StreamEncryptor &encryptor,
+                                              Chksum &chksum, SCipherBuffer &pending, const size_t needed) {
+    try {
+        while (pending.size() < needed) {
+            const uint64_t remaining = _self.fileSize - chksum.size();
+            if (remaining == 0) {
+                pending.commit(encryptor.final(pending.reserve(encryptor.outputBound(0))));
+                break;
+            }
+
+            // checksum and encrypt straight from the file's mapping or read-ahead buffer, without copying
+            std::span<const uint8_t> plain;
+            if (!file.readSpan(std::min<uint64_t>(READ_SIZE, remaining), plain) || plain.empty()) {
+                clearLastError();
+                _lastError << "Was unable to read from file, it may have changed while being sent";
+                co_return false;
+            }
+            // the block is checksummed on the pool while it's encrypted, the span must stay valid until then
+            ThreadPool::Pending<Chksum> partial = Chksum::start(plain);
+            uint8_t *cipher = pending.reserve(encryptor.outputBound(plain.size()));
+            size_t written = 0;
+            std::exception_ptr failure;
+            try {
+                written = co_await encryptor.updateAsync(plain.data(), plain.size(), cipher);
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            const Chksum block = co_await partial.get();
+            chksum.combine(block);
+            if (failure)
+                std::rethrow_exception(failure);
+            // a mapped file truncated while the block was used reads as zeros, what was sent of it is wrong
+            if (file.wasTruncated()) {
+                clearLastError();
+                _lastError << "Was unable to read from file, it may have changed while being sent";
+                co_return false;
+            }
+            pending.commit(written);
+        }
+    } catch(CryptoPP::Exception& e) {
+        clearLastError();
+        _lastError << "Exception occurred while encrypting file: " << e.what();
+        co_return false;
+    }
+
+    if (pending.size() < needed) {
+        clearLastError();
+        _lastError << "Encrypted content of the file is shorter than announced";
+        co_return false;
+    }
+    co_return true;
+}
+
 /**
  * Send a message to the server, with its corresponding crc validation,
  * receiving a thank-you response in case of success
  */
-bool ClientLogic::sendCRCMessage(const ERequestCode code) {
+awaitable<bool> ClientLogic::sendCRCMessageAsync(const ERequestCode code) {
     SendMessage request(_self.id, _self.fileName, code);
     SResponseClientID response;
 
     // Serialize the request
-    std::vector<uint8_t> serializedRequest =
-            std::vector<uint8_t>(
-                    reinterpret_cast<const uint8_t *>(&request),
-                    reinterpret_cast<const uint8_t *>(&request) + sizeof(request));
+    std::vector<uint8_t> serializedRequest = Schema::serialize(request);
 
     // send request and receive response's header
-    std::vector<uint8_t> responseData;
-    if (!_socketHandler->communicate(serializedRequest, responseData, sizeof(response)))
+    const bool communicated = co_await _socketHandler->communicateAsync(serializedRequest, Schema::image(response));
+    if (!communicated)
     {
         clearLastError();
         _lastError << "Failed communicating with server on " << _socketHandler;
-        return false;
+        co_return false;
     }
 
     // Deserialize the response
-    std::memcpy(&response, responseData.data(), sizeof(response));
+    Schema::fromWire(response);
 
     if(!validateHeader(response.header, APPROVED_GETTING_MESSAGE_THANKS)) {
-        return false;
+        co_return false;
     }
 
     if(response.payload != _self.id)
     {
         clearLastError();
         _lastError << "Received a response with client id not the same as it was when registered";
-        return false;
+        co_return false;
     }
-    return true;
+    co_return true;
 }
 
 /**
@@ -583,16 +1352,8 @@ bool ClientLogic::parseInfo() {
         return false;
     }
 
-    // store and validate if the file is too large
-    csize_t size;
-    if((size = _fileHandle->size()) > std::numeric_limits<uint16_t>::max())
-    {
-        clearLastError();
-        _lastError << "Encrypted content of the file (" << line << ")larger than ("
-                   <<  std::numeric_limits<uint16_t>::max() << ")";
-        return false;
-    }
-    _self.fileSize = size;
+    // store the file's size, whether the server takes a file that large is known only when sending it
+    _self.fileSize = _fileHandle->size();
     closeFile();
 
     // save file name
@@ -602,27 +1363,14 @@ bool ClientLogic::parseInfo() {
 
 
 bool ClientLogic::validateHeader(const SResponseHeader &header, const EResponseCode expectedCode) {
-    csize_t expectedSize = 0;
-
     switch (header.code)
     {
-        case REGISTRATION_SUCCEEDED:
-        {
-            expectedSize = sizeof(SResponseClientID) - sizeof(SResponseHeader);
-            break;
-        }
         case REGISTRATION_FAILED:
         {
             clearLastError();
             _lastError << "Registration error response code (" << REGISTRATION_FAILED << ") received.";
             return false;
         }
-        case RECEIVED_PUBLIC_KEY_AND_SENDING_AES:
-        case APPROVED_REQUEST_TO_RECONNECT_SENDING_AES:
-        {
-            expectedSize = sizeof(SResponseAESKey) - sizeof(SResponseHeader);
-            break;
-        }
         case REQUEST_FOR_RECONNECTION_DENIED:
         {
             clearLastError();
@@ -630,19 +1378,6 @@ bool ClientLogic::validateHeader(const SResponseHeader &header, const EResponseC
                        << REQUEST_FOR_RECONNECTION_DENIED << ") received. client needs to register again";
             return false;
         }
-
-        case FILE_RECEIVED_PROPERLY_WITH_CRC:
-        {
-            expectedSize = sizeof(SResponseReceivedValidFileWithCRC) - sizeof(SResponseHeader);
-            break;
-        }
-
-        case APPROVED_GETTING_MESSAGE_THANKS:
-        {
-            expectedSize = sizeof(Uuid);
-            break;
-        }
-
         case GENERIC_ERROR:
         {
             clearLastError();
@@ -659,6 +1394,9 @@ bool ClientLogic::validateHeader(const SResponseHeader &header, const EResponseC
         return false;
     }
 
+    // the capabilities tell the server's version themselves, the other layouts follow the version they told
+    const version_t version = header.code == SERVER_CAPABILITIES ? header.version : _server.version;
+    const csize_t expectedSize = Schema::expectedPayloadSize(header.code, version);
     if (header.payloadSize != expectedSize)
     {
         clearLastError();
@@ -676,7 +1414,7 @@ bool ClientLogic::validateHeader(const SResponseHeader &header, const EResponseC
  */
 bool ClientLogic::storeClientInfo() {
     _fileHandle = std::make_unique<FileHandle>();
-    if (!_fileHandle->open(CLIENT_INFO, true))
+    if (!_fileHandle->open(inDirectory(CLIENT_INFO), true))
     {
         clearLastError();
         _lastError << "Couldn't open " << CLIENT_INFO;
@@ -715,7 +1453,7 @@ bool ClientLogic::storeClientInfo() {
     // we finished writing userName, uuid and private key into "me.info" file,
     // and now writing the private key additionally into "priv.key" file
     _fileHandle = std::make_unique<FileHandle>();
-    if (!_fileHandle->open(KEY_INFO, true))
+    if (!_fileHandle->open(inDirectory(KEY_INFO), true))
     {
         clearLastError();
         _lastError << "Couldn't open " << KEY_INFO;
@@ -735,6 +1473,63 @@ bool ClientLogic::storeClientInfo() {
 }
 
 
+/**
+ * Load the ticket of the previous session, if there is one. Reconnecting works without it.
+ */
+void ClientLogic::loadTicket() {
+    _resumption = SResumption();
+    FileHandle file;
+    std::string ticket, secret, expiry;
+    if (!file.open(inDirectory(TICKET_INFO)) || !file.readLine(ticket) || !file.readLine(secret) || !file.readLine(expiry))
+        return;
+    Base64Wrapper::trim(ticket);
+    Base64Wrapper::trim(secret);
+    Base64Wrapper::trim(expiry);
+    ticket = Base64Wrapper::unhex(ticket);
+    secret = Base64Wrapper::unhex(secret);
+    if (ticket.size() != TICKET_SIZE || secret.size() != AES_KEY_SIZE ||
+        expiry.empty() || !std::all_of(expiry.begin(), expiry.end(), ::isdigit))
+        return;
+
+    std::copy_n(ticket.begin(), TICKET_SIZE, _resumption.ticket.begin());
+    std::copy_n(secret.begin(), AES_KEY_SIZE, _resumption.secret.begin());
+    _resumption.expiry = std::stoull(expiry);
+}
+
+/**
+ * Keep the ticket the server issued for this session, along with the secret the next session's key
+ * is derived from. A response without a lifetime deletes the stored ticket.
+ */
+bool ClientLogic::storeTicket(const SResponseSessionTicket &response) {
+    _resumption = SResumption();
+    if (response.payload.lifetime == 0) {
+        if (!FileHandle::remove(inDirectory(TICKET_INFO))) {
+            clearLastError();
+            _lastError << "Couldn't delete the session ticket " << TICKET_INFO;
+            return false;
+        }
+        return true;
+    }
+    _resumption.ticket = response.payload.ticket;
+    _resumption.secret = AESWrapper::deriveKey(_self.aesKey, nullptr, 0, RESUMPTION_INFO);
+    _resumption.expiry = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() + response.payload.lifetime;
+
+    FileHandle file;
+    const std::string ticket(_resumption.ticket.begin(), _resumption.ticket.end());
+    const std::string secret(_resumption.secret.begin(), _resumption.secret.end());
+    if (!file.open(inDirectory(TICKET_INFO), true) ||
+        !file.writeLine(Base64Wrapper::hex(ticket)) ||
+        !file.writeLine(Base64Wrapper::hex(secret)) ||
+        !file.writeLine(std::to_string(_resumption.expiry)))
+    {
+        clearLastError();
+        _lastError << "Couldn't write the session ticket to " << TICKET_INFO;
+        return false;
+    }
+    return true;
+}
+
 void ClientLogic::closeFile() {
     if (_fileHandle) {
         _fileHandle->close();
@@ -744,7 +1539,7 @@ void ClientLogic::closeFile() {
 
 bool ClientLogic::isFileEmptyAndOpen(const std::string &filePath) {
     _fileHandle = std::make_unique<FileHandle>();
-    if (!_fileHandle->open(filePath))
+    if (!_fileHandle->open(inDirectory(filePath)))
     {
         clearLastError();
         _lastError << "Couldn't open file: " << filePath;
@@ -766,7 +1561,3 @@ void ClientLogic::clearLastError() {
     _lastError.copyfmt(clean);
 }
 
-void ClientLogic::clientStop() const {
-    std::cout << "Fatal Error from client side: " << getLastError() << std::endl;
-    exit(1); // end program
-}
@@ -2,14 +2,283 @@
 // Created by גאי ברנשטיין on 20/09/2024.
 //
 #include "FileHandle.h"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#elif defined(__APPLE__)
+#include <sys/mount.h>
+#endif
 
-FileHandle::FileHandle() : _isOpen(false), _isWriteMode(false) {}
+/**
+ * A file's mapping the SIGBUS handler may patch: a page past the end of a file truncated while it's mapped
+ * is replaced with a zero page, instead of killing the process, and the range is marked truncated.
+ * Ranges are never freed, only reused, so the handler can walk them while files are mapped and unmapped.
+ */
+struct FileHandle::MappedRange
+{
+    std::atomic<uintptr_t> begin{0};
+    std::atomic<uintptr_t> end{0};
+    std::atomic<bool>      inUse{false};
+    std::atomic<bool>      truncated{false};
+    MappedRange*           next = nullptr;
+
+    static MappedRange* acquire(const uint8_t* mapping, size_t size);
+    void release();
+
+private:
+    static void onBusError(int number, siginfo_t* info, void* context);
+
+    static std::atomic<MappedRange*> head;
+    static size_t                    pageSize;  // sysconf isn't async-signal-safe, it's read before any fault
+    static struct sigaction          previous;  // the handler faults outside the mappings go to
+};
+
+std::atomic<FileHandle::MappedRange*> FileHandle::MappedRange::head{nullptr};
+size_t FileHandle::MappedRange::pageSize = 0;
+struct sigaction FileHandle::MappedRange::previous{};
+
+FileHandle::MappedRange* FileHandle::MappedRange::acquire(const uint8_t* mapping, const size_t size)
+{
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        struct sigaction action{};
+        action.sa_sigaction = &MappedRange::onBusError;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, &previous);
+    });
+
+    MappedRange* range = head.load();
+    for (; range != nullptr; range = range->next) {
+        bool free = false;
+        if (range->inUse.compare_exchange_strong(free, true))
+            break;
+    }
+    if (range == nullptr) {
+        range = new MappedRange;   // never freed, see above
+        range->inUse = true;
+        range->next = head.load();
+        while (!head.compare_exchange_weak(range->next, range)) {}
+    }
+    range->truncated = false;
+    range->begin = reinterpret_cast<uintptr_t>(mapping);
+    range->end = reinterpret_cast<uintptr_t>(mapping) + size;
+    return range;
+}
+
+/**
+ * To be called before the mapping is unmapped.
+ */
+void FileHandle::MappedRange::release()
+{
+    end = 0;
+    begin = 0;
+    truncated = false;
+    inUse = false;
+}
+
+void FileHandle::MappedRange::onBusError(const int number, siginfo_t* info, void* context)
+{
+    const auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (MappedRange* range = head.load(); range != nullptr; range = range->next) {
+        if (address < range->begin.load() || address >= range->end.load())
+            continue;
+        // returning retries the access, which now reads the zero page
+        void* page = reinterpret_cast<void*>(address / pageSize * pageSize);
+        if (mmap(page, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            break;
+        range->truncated = true;
+        return;
+    }
+
+    // not ours: whoever handled SIGBUS before does, or the default action kills the process as it would have
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(number, info, context);
+        return;
+    }
+    if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(number);
+        return;
+    }
+    struct sigaction fallback{};
+    fallback.sa_handler = SIG_DFL;
+    sigemptyset(&fallback.sa_mask);
+    sigaction(SIGBUS, &fallback, nullptr);
+}
+
+/**
+ * Read-ahead mode: a thread fills a pool of aligned buffers in file order,
+ * while the reader works through the ones filled before.
+ */
+struct FileHandle::ReadAhead
+{
+    static constexpr size_t BUFFER_SIZE  = 1 << 20;
+    static constexpr size_t BUFFER_COUNT = 4;
+    static constexpr size_t ALIGNMENT    = 4096;    // O_DIRECT wants buffers, offsets and lengths block aligned
+    static constexpr size_t NONE         = BUFFER_COUNT;
+
+    explicit ReadAhead(int fd);
+    ~ReadAhead();
+    bool next(size_t length, std::span<const uint8_t> &data);
+
+private:
+    void work();
+
+    const int               _fd;
+    bool                    _direct;    // the file is read with O_DIRECT
+    std::vector<uint8_t *>  _buffers;
+    std::vector<size_t>     _lengths;   // bytes read into each buffer
+    std::queue<size_t>      _free;      // buffers the worker may fill
+    std::queue<size_t>      _filled;    // buffers the reader may take, in file order
+    bool                    _finished;  // the worker got to the end of the file, or failed
+    bool                    _failed;
+    bool                    _stopping;
+    size_t                  _current;   // the buffer the reader is at, NONE between buffers
+    size_t                  _consumed;  // bytes of the current buffer handed out
+    std::mutex              _mutex;
+    std::condition_variable _condition;
+    std::thread             _worker;
+};
+
+FileHandle::ReadAhead::ReadAhead(const int fd) : _fd(fd), _direct(false), _lengths(BUFFER_COUNT, 0), _finished(false),
+                                                 _failed(false), _stopping(false), _current(NONE), _consumed(0)
+{
+#ifdef O_DIRECT
+    _direct = (fcntl(_fd, F_GETFL) & O_DIRECT) != 0;
+#endif
+    for (size_t i = 0; i < BUFFER_COUNT; i++) {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, ALIGNMENT, BUFFER_SIZE) != 0)
+            throw std::bad_alloc();
+        _buffers.push_back(static_cast<uint8_t *>(buffer));
+        _free.push(i);
+    }
+    _worker = std::thread(&ReadAhead::work, this);
+}
+
+FileHandle::ReadAhead::~ReadAhead()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _condition.notify_all();
+    _worker.join();
+    for (auto buffer : _buffers)
+        std::free(buffer);
+}
+
+/**
+ * Worker loop, read the file into free buffers until its end.
+ */
+void FileHandle::ReadAhead::work()
+{
+    off_t offset = 0;
+    while (true) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this]() { return _stopping || !_free.empty(); });
+            if (_stopping)
+                return;
+            index = _free.front();
+            _free.pop();
+        }
+
+        // network file systems may return short reads before the end of the file,
+        // with O_DIRECT the rest is read again from the block the short read ended in, to stay aligned
+        size_t length = 0;
+        bool failed = false;
+        while (length < BUFFER_SIZE) {
+            const size_t from = _direct ? length / ALIGNMENT * ALIGNMENT : length;
+            const ssize_t bytesRead = pread(_fd, _buffers[index] + from, BUFFER_SIZE - from,
+                                            offset + static_cast<off_t>(from));
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0) {
+                failed = bytesRead < 0;
+                break;
+            }
+            if (from + static_cast<size_t>(bytesRead) <= length)
+                break;  // nothing past the short read, it was the end of the file
+            length = from + static_cast<size_t>(bytesRead);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _lengths[index] = length;
+            _filled.push(index);
+            _failed = failed;
+            _finished = failed || length < BUFFER_SIZE;
+        }
+        _condition.notify_all();
+        if (failed || length < BUFFER_SIZE)
+            return;
+        offset += static_cast<off_t>(length);
+    }
+}
+
+/**
+ * A view of the next (up to) length bytes of the current buffer, the buffer before it is given back to the worker.
+ * Empty at the end of the file, false if reading it failed.
+ */
+bool FileHandle::ReadAhead::next(size_t length, std::span<const uint8_t> &data)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_current != NONE && _consumed == _lengths[_current]) {
+        _free.push(_current);
+        _current = NONE;
+        _condition.notify_all();
+    }
+
+    if (_current == NONE) {
+        _condition.wait(lock, [this]() { return !_filled.empty() || _finished; });
+        if (_filled.empty()) {
+            data = {};
+            return !_failed;
+        }
+        _current = _filled.front();
+        _filled.pop();
+        _consumed = 0;
+    }
+
+    length = std::min(length, _lengths[_current] - _consumed);
+    data = std::span<const uint8_t>(_buffers[_current] + _consumed, length);
+    _consumed += length;
+    return true;
+}
+
+FileHandle::FileHandle() : _isOpen(false), _isWriteMode(false), _fd(-1), _fileSize(0), _mapping(nullptr),
+                           _range(nullptr), _position(0), _released(0), _advised(0) {}
 
 FileHandle::~FileHandle()
 {
     close();
 }
 
+/**
+ * Delete a file, true when it is gone, also when there was no such file.
+ */
+bool FileHandle::remove(const std::string& filepath)
+{
+    boost::system::error_code error;
+    (void)boost::filesystem::remove(filepath, error);
+    return !error;
+}
+
 /**
  * Open a file for read/write. Create folders in filepath if do not exist.
  * Relative paths not supported!
@@ -57,7 +326,18 @@ void FileHandle::close()
 {
     if(!_isOpen)
         return;
-    if (_isWriteMode) {
+    if (isMapped() || isReadAhead()) {
+        if (isMapped()) {
+            _range->release();
+            _range = nullptr;
+            munmap(const_cast<uint8_t *>(_mapping), _fileSize);
+        }
+        _readAhead.reset();     // stops its thread before the file is closed
+        ::close(_fd);
+        _mapping = nullptr;
+        _fd = -1;
+    }
+    else if (_isWriteMode) {
         _outStream.close();
     }
     else {
@@ -135,6 +415,232 @@ bool FileHandle::readChunk(std::string &chunk, csize_t chunkSize, bool &eof) {
     }
 }
 
+/**
+ * Read up to length bytes into buffer, bytesRead is short of length only at the end of the file.
+ */
+bool FileHandle::read(char* buffer, size_t length, size_t &bytesRead) {
+    bytesRead = 0;
+    if (!isOpen() || isWriteMode()) {
+        close();
+        return false;
+    }
+
+    if (isMapped() || isReadAhead()) {
+        std::span<const uint8_t> data;
+        if (!readSpan(length, data))
+            return false;
+        std::copy(data.begin(), data.end(), buffer);
+        bytesRead = data.size();
+        return true;
+    }
+
+    try {
+        _inStream.read(buffer, static_cast<std::streamsize>(length));
+        bytesRead = static_cast<size_t>(_inStream.gcount());
+        return !_inStream.bad();
+    }
+    catch (...)
+    {
+        close();
+        return false;
+    }
+}
+
+/**
+ * Map a regular file for reading. Fails for empty files and anything that isn't a regular file,
+ * which should be read through open() instead.
+ */
+bool FileHandle::openMapped(const std::string& filepath)
+{
+    if (filepath.empty())
+        return false;
+    close(); // Close any previously open streams
+    _isWriteMode = false;
+
+    _fd = ::open(filepath.c_str(), O_RDONLY);
+    if (_fd < 0)
+        return false;
+
+    struct stat status{};
+    void *mapping = MAP_FAILED;
+    if (fstat(_fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0)
+        mapping = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, _fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _mapping = static_cast<const uint8_t *>(mapping);
+    _fileSize = static_cast<size_t>(status.st_size);
+    _range = MappedRange::acquire(_mapping, _fileSize);
+    _position = _released = _advised = 0;
+    (void)madvise(mapping, _fileSize, MADV_SEQUENTIAL);
+    advanceMapping();
+    _isOpen = true;
+    return true;
+}
+
+/**
+ * A view of the next (up to) length bytes, empty at the end of the file.
+ * It's valid until the next call: a mapping's pages behind it may be dropped then.
+ */
+bool FileHandle::readSpan(size_t length, std::span<const uint8_t> &data)
+{
+    if (isReadAhead())
+        return _readAhead->next(length, data);
+
+    if (!isMapped()) {
+        _spanBuffer.resize(length);
+        size_t bytesRead;
+        if (!read(reinterpret_cast<char *>(_spanBuffer.data()), length, bytesRead))
+            return false;
+        data = std::span<const uint8_t>(_spanBuffer.data(), bytesRead);
+        return true;
+    }
+
+    length = std::min(length, _fileSize - _position);
+
+    // a file already truncated is read up to its end rather than through the mapping. One truncated after this,
+    // while the span is still being used, reads as zeros past its end, and wasTruncated() tells so afterwards.
+    struct stat status{};
+    if (fstat(_fd, &status) != 0 || static_cast<size_t>(status.st_size) < _position + length) {
+        _spanBuffer.resize(length);
+        ssize_t bytesRead;
+        do {
+            bytesRead = pread(_fd, _spanBuffer.data(), length, static_cast<off_t>(_position));
+        } while (bytesRead < 0 && errno == EINTR);
+        if (bytesRead < 0)
+            return false;
+        data = std::span<const uint8_t>(_spanBuffer.data(), static_cast<size_t>(bytesRead));
+        _position += static_cast<size_t>(bytesRead);
+        return true;
+    }
+
+    if (_position - _released >= MAPPING_WINDOW || _position + MAPPING_WINDOW / 2 > _advised)
+        advanceMapping();
+    data = std::span<const uint8_t>(_mapping + _position, length);
+    _position += length;
+    return true;
+}
+
+/**
+ * Whether the mapped file got shorter than what was read of it, so the spans read may hold zeros rather than its
+ * content. To be checked once they were used.
+ */
+bool FileHandle::wasTruncated() const
+{
+    if (!isMapped())
+        return false;
+    struct stat status{};
+    return _range->truncated.load() || fstat(_fd, &status) != 0 || static_cast<size_t>(status.st_size) < _position;
+}
+
+/**
+ * Open a file to be read by a background thread, optionally bypassing the page cache (O_DIRECT, or F_NOCACHE).
+ */
+bool FileHandle::openReadAhead(const std::string& filepath, const bool direct)
+{
+    if (filepath.empty())
+        return false;
+    close(); // Close any previously open streams
+    _isWriteMode = false;
+
+#ifdef O_DIRECT
+    if (direct)
+        _fd = ::open(filepath.c_str(), O_RDONLY | O_DIRECT);
+#endif
+    if (_fd < 0)
+        _fd = ::open(filepath.c_str(), O_RDONLY);  // not every file system takes O_DIRECT
+    if (_fd < 0)
+        return false;
+#ifdef F_NOCACHE
+    if (direct)
+        (void)fcntl(_fd, F_NOCACHE, 1);
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+    (void)posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    struct stat status{};
+    if (fstat(_fd, &status) != 0) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _fileSize = static_cast<size_t>(status.st_size);
+
+    try {
+        _readAhead = std::make_unique<ReadAhead>(_fd);
+    }
+    catch (...) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _isOpen = true;
+    return true;
+}
+
+/**
+ * Whether the file is on a network or FUSE file system, where mapping it stalls on every page fault.
+ */
+bool FileHandle::isNetworkFileSystem(const std::string& filepath)
+{
+#if defined(__linux__)
+    struct statfs status{};
+    if (statfs(filepath.c_str(), &status) != 0)
+        return false;
+    switch (static_cast<unsigned long>(status.f_type)) {
+        case 0x6969:        // NFS
+        case 0x517B:        // SMB
+        case 0xFF534D42:    // CIFS
+        case 0xFE534D42:    // SMB2
+        case 0x65735546:    // FUSE
+        case 0x00C36400:    // Ceph
+        case 0x01021997:    // 9P
+        case 0x5346414F:    // AFS
+            return true;
+        default:
+            return false;
+    }
+#elif defined(__APPLE__)
+    struct statfs status{};
+    if (statfs(filepath.c_str(), &status) != 0)
+        return false;
+    const std::string type(status.f_fstypename);
+    return type == "nfs" || type == "smbfs" || type == "afpfs" || type == "webdav" ||
+           type.find("fuse") != std::string::npos;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Drop the pages the reader is done with, and ask for the next window to be read ahead.
+ */
+void FileHandle::advanceMapping()
+{
+    const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t behind = _position / pageSize * pageSize;
+    if (behind > _released) {
+        (void)madvise(const_cast<uint8_t *>(_mapping) + _released, behind - _released, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+        // a large file would otherwise push everything else out of the page cache
+        (void)posix_fadvise(_fd, static_cast<off_t>(_released), static_cast<off_t>(behind - _released),
+                            POSIX_FADV_DONTNEED);
+#endif
+        _released = behind;
+    }
+
+    const size_t ahead = std::min(_fileSize, behind + MAPPING_WINDOW);
+    if (ahead > _advised) {
+        const size_t from = std::max(_advised, behind);
+        (void)madvise(const_cast<uint8_t *>(_mapping) + from, ahead - from, MADV_WILLNEED);
+        _advised = ahead;
+    }
+}
+
 /**
  * Write data to fs.
  */
@@ -201,6 +707,8 @@ bool FileHandle::writeLine(const std::string &line)
 size_t FileHandle::size() {
     if (!isOpen())
         return 0;
+    if (isMapped() || isReadAhead())
+        return _fileSize;
     try
     {
         if(isWriteMode()){
@@ -208,13 +716,13 @@ size_t FileHandle::size() {
             _outStream.seekp(0, std::ios::end);
             const auto size = _outStream.tellp();
             _outStream.seekp(cur);  // restore position
-            return (size > 0 && size <= UINT32_MAX) ? static_cast<size_t>(size) : 0;
+            return size > 0 ? static_cast<size_t>(size) : 0;
         } else {
             const auto cur = _inStream.tellg();
             _inStream.seekg(0, std::ios::end);
             const auto size = _inStream.tellg();
             _inStream.seekg(cur);  // restore position
-            return (size > 0 && size <= UINT32_MAX) ? static_cast<size_t>(size) : 0;
+            return size > 0 ? static_cast<size_t>(size) : 0;
         }
     }
     catch (...)
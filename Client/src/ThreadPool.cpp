@@ -0,0 +1,85 @@
+//
+// Fixed size pool of worker threads, shared by the cpu heavy parts of the client.
+//
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t threads) : _stopping(false)
+{
+    if (threads == 0)   // hardware_concurrency may not know
+        threads = 1;
+    _workers.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        _workers.emplace_back(&ThreadPool::work, this);
+}
+
+/**
+ * Let the workers drain the queue, then join them.
+ */
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _condition.notify_all();
+    for (auto& worker : _workers)
+        worker.join();
+}
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/**
+ * Run the tasks on the pool and await them all. The first failure is rethrown once none of them runs anymore,
+ * they may write to the caller's buffers.
+ */
+boost::asio::awaitable<void> ThreadPool::all(std::vector<std::function<void()>> tasks)
+{
+    std::vector<Pending<void>> started;
+    started.reserve(tasks.size());
+    for (auto& task : tasks)
+        started.push_back(start(std::move(task)));
+
+    std::exception_ptr failure;
+    for (auto& pending : started) {
+        try {
+            co_await pending.get();
+        } catch (...) {
+            if (!failure)
+                failure = std::current_exception();
+        }
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push(std::move(task));
+    }
+    _condition.notify_one();
+}
+
+/**
+ * Worker loop, run queued tasks until the pool is destroyed.
+ */
+void ThreadPool::work()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+            if (_tasks.empty())
+                return;     // stopping, and nothing left to run
+            task = std::move(_tasks.front());
+            _tasks.pop();
+        }
+        task();
+    }
+}
@@ -0,0 +1,31 @@
+//
+// Runs the sessions' coroutines, their socket I/O and protocol steps, on a handful of threads.
+//
+#include "TransferEngine.h"
+
+TransferEngine::TransferEngine(size_t threads) : _work(boost::asio::make_work_guard(_context))
+{
+    if (threads == 0)   // hardware_concurrency may not know
+        threads = 1;
+    _threads.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+        _threads.emplace_back([this]() { _context.run(); });
+}
+
+TransferEngine::~TransferEngine()
+{
+    join();
+}
+
+/**
+ * Let the running sessions finish, then stop the threads.
+ * A session spawned afterwards is not run.
+ */
+void TransferEngine::join()
+{
+    _work.reset();
+    for (auto& thread : _threads) {
+        if (thread.joinable())
+            thread.join();
+    }
+}
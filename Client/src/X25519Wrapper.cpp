@@ -0,0 +1,55 @@
+#include "X25519Wrapper.h"
+#include <hkdf.h>
+#include <sha.h>
+#include <algorithm>
+#include <cstring>
+
+// binds the derived key to its use, the server derives it with the same info
+static const char AGREED_KEY_INFO[] = "file transfer aes key";
+
+X25519Wrapper::X25519Wrapper()
+{
+	_domain.GenerateKeyPair(_rng, _privateKey, _publicKey);
+}
+
+X25519Wrapper::X25519Wrapper(const std::string& privateKey)
+{
+	if (privateKey.size() != KEYSIZE)
+		throw CryptoPP::Exception(CryptoPP::Exception::OTHER_ERROR, "Invalid X25519 private key length");
+	std::memcpy(_privateKey, privateKey.data(), KEYSIZE);
+	_domain.GeneratePublicKey(_rng, _privateKey, _publicKey);
+}
+
+X25519Wrapper::~X25519Wrapper()
+{
+	std::fill_n(_privateKey, KEYSIZE, 0);
+}
+
+std::string X25519Wrapper::getPrivateKey() const
+{
+	return std::string(reinterpret_cast<const char*>(_privateKey), KEYSIZE);
+}
+
+AgreementKey X25519Wrapper::getPublicKey() const
+{
+	AgreementKey key;
+	std::copy_n(_publicKey, KEYSIZE, key.begin());
+	return key;
+}
+
+/**
+ * Agree on a shared secret with the peer's public key, and derive the AES key from it with HKDF-SHA256.
+ */
+AESKey X25519Wrapper::deriveKey(const AgreementKey& peerPublicKey, const KeySalt& salt) const
+{
+	CryptoPP::byte shared[KEYSIZE];
+	if (!_domain.Agree(shared, _privateKey, peerPublicKey.data()))
+		throw CryptoPP::Exception(CryptoPP::Exception::OTHER_ERROR, "X25519 key agreement failed");
+
+	AESKey key;
+	CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+	hkdf.DeriveKey(key.data(), key.size(), shared, sizeof(shared), salt.data(), salt.size(),
+	               reinterpret_cast<const CryptoPP::byte*>(AGREED_KEY_INFO), sizeof(AGREED_KEY_INFO) - 1);
+	std::fill_n(shared, KEYSIZE, 0);
+	return key;
+}
@@ -6,6 +6,7 @@ The constants and routine are cribbed from the POSIX man page
 """
 import logging
 import sys
+import zlib
 
 crctab = [0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc,
           0x17c56b6b, 0x1a864db2, 0x1e475005, 0x2608edb8, 0x22c9f00f,
@@ -62,6 +63,36 @@ crctab = [0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc,
 
 UNSIGNED = lambda n: n & 0xffffffff
 
+# zlib's crc32 uses the same polynomial, bit reflected. Feeding it bit reversed bytes gives
+# the bit reversed cksum register, so the heavy lifting is done in C.
+REVERSED_BYTES = bytes(int(f"{i:08b}"[::-1], 2) for i in range(256))
+
+
+def reverse32(n):
+    return int(f"{n:032b}"[::-1], 2)
+
+
+class Cksum:
+    """ Incremental cksum, for content that arrives or is read in pieces """
+    def __init__(self):
+        self.s = 0  # register over the data so far, before the length is appended
+        self.n = 0
+
+    def update(self, b):
+        # zlib's crc32 takes and returns the complemented register
+        reflected = UNSIGNED(~zlib.crc32(b.translate(REVERSED_BYTES), UNSIGNED(~reverse32(self.s))))
+        self.s = reverse32(reflected)
+        self.n += len(b)
+
+    def digest(self):
+        n = self.n
+        s = self.s
+        while n:
+            c = n & 0o377
+            n = n >> 8
+            s = UNSIGNED(s << 8) ^ crctab[(s >> 24) ^ c]
+        return UNSIGNED(~s)
+
 
 def memcrc(b):
     n = len(b)
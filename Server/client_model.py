@@ -1,5 +1,6 @@
+import tempfile
+
 import protocol
-from collections import defaultdict
 
 
 class Client:
@@ -7,8 +8,28 @@ class Client:
     def __init__(self, cid, client_name):
         self.id = bytes.fromhex(cid)  # Unique client ID, 16 bytes.
         self.name = client_name  # Client's name, null terminated ascii string, 100 bytes.
-        self.public_key = None  # Client's public key, 160 bytes.
-        self.file_content = defaultdict(bytearray)
+        self.public_key = None  # Client's public key, 160 bytes RSA or 32 bytes X25519.
+        self.file_content = {}  # Files being received, by name.
+        self.transfers = {}  # Descriptions of the files being received in compact packets, by transfer ID.
+        # Transfers received completely, by transfer ID, with the packet that completed each and its CRC reply.
+        # A packet still in flight over a connection that failed is sent again, and answered from them.
+        self.completed = {}
+
+    def complete_transfer(self, transfer_id, packet_number, reply, kept=protocol.COMPLETED_TRANSFERS_KEPT):
+        """ Move a transfer received completely to the completed ones, keeping the latest ones only """
+        self.completed[transfer_id] = (self.transfers.pop(transfer_id), packet_number, reply)
+        while len(self.completed) > kept:
+            del self.completed[next(iter(self.completed))]
+
+    def forget_transfers(self, file_name):
+        """ Drop the transfers of a file, open or completed, once it's sent again or its CRC was settled """
+        self.transfers = {transfer_id: transfer for transfer_id, transfer in self.transfers.items()
+                          if transfer.file_name != file_name}
+        self.completed = {transfer_id: completed for transfer_id, completed in self.completed.items()
+                          if completed[0].file_name != file_name}
+
+    def has_agreement_key(self):
+        return self.public_key is not None and len(self.public_key) == protocol.AGREEMENT_KEY_SIZE
 
     def validate(self):
         """ Validate Client attributes according to the requirements """
@@ -16,8 +37,43 @@ class Client:
             return False
         if not self.name or len(self.name) >= protocol.NAME_SIZE:
             return False
-        if not self.public_key or len(self.public_key) != protocol.PUBLIC_KEY_SIZE:
+        if not self.public_key or len(self.public_key) not in (protocol.PUBLIC_KEY_SIZE, protocol.AGREEMENT_KEY_SIZE):
             return False
         return True
 
 
+class IncomingFile:
+    """ Content of a file being received, spooled to disk at each packet's offset.
+    Encrypted, or already decrypted when its packets are sealed one by one. """
+    def __init__(self, total_packets, content_size):
+        self.spool = tempfile.TemporaryFile()
+        self.total_packets = total_packets
+        self.content_size = content_size
+        self.received = 0
+        self.written = bytearray(total_packets)  # whether each packet was written, a packet sent twice counts once
+        self.started = False  # the first packet was written
+
+    def write(self, packet_number, chunk_size, content):
+        self.spool.seek((packet_number - 1) * chunk_size)
+        self.spool.write(content)
+        if not self.written[packet_number - 1]:
+            self.written[packet_number - 1] = 1
+            self.received += 1
+        self.started = self.started or packet_number == 1
+
+    def is_complete(self):
+        return self.received >= self.total_packets
+
+    def read_into(self, write, block_size=1 << 16):
+        """ Pass the spooled content to write a block at a time """
+        self.spool.seek(0)
+        while data := self.spool.read(block_size):
+            write(data)
+        return True
+
+    def size(self):
+        self.spool.seek(0, 2)
+        return self.spool.tell()
+
+    def close(self):
+        self.spool.close()
@@ -1,13 +1,25 @@
 from Crypto.Cipher import AES, PKCS1_OAEP
-from Crypto.PublicKey import RSA
+from Crypto.Hash import SHA256
+from Crypto.Protocol.DH import import_x25519_public_key, key_agreement
+from Crypto.Protocol.KDF import HKDF
+from Crypto.PublicKey import ECC, RSA
 from Crypto.Random import get_random_bytes
 from Crypto.Util.Padding import unpad
+import struct
+
+from protocol import ECipherMode, GCM_NONCE_SIZE, GCM_TAG_SIZE, KEY_SALT_SIZE
+
+AGREED_KEY_INFO = b"file transfer aes key"  # the client derives the key with the same info
+RESUMPTION_INFO = b"file transfer resumption"
+RESUMED_KEY_INFO = b"file transfer resumed aes key"
+TRANSFER_KEY_INFO = b"file transfer content key"
+TICKET_NONCE_SIZE = 12
 
 
 class AESCipher:
 
-    def __init__(self):
-        self.key = get_random_bytes(AES.block_size)
+    def __init__(self, key=None):
+        self.key = key or get_random_bytes(AES.block_size)
 
     def encrypt_aes_with_rsa(self, public_key):
         try:
@@ -19,10 +31,94 @@ class AESCipher:
             return None
 
 
-def decrypt_message(key, message):
+def agree_on_aes_key(client_public_key):
+    """ X25519 agreement of a fresh server key with the client's, the AES key is derived with HKDF-SHA256.
+    Returns the AESCipher, the server's public key and the salt, or None """
+    try:
+        server_key = ECC.generate(curve='curve25519')
+        shared = key_agreement(static_priv=server_key, static_pub=import_x25519_public_key(client_public_key),
+                               kdf=lambda z: z)
+        salt = get_random_bytes(KEY_SALT_SIZE)
+        key = HKDF(shared, AES.block_size, salt, SHA256, context=AGREED_KEY_INFO)
+        return AESCipher(key), server_key.public_key().export_key(format='raw'), salt
+    except (ValueError, TypeError):
+        return None
+
+
+def decrypt_message(key, message, mode=ECipherMode.CBC):
     try:
+        if mode == ECipherMode.CTR:
+            aes = AES.new(key, AES.MODE_CTR, nonce=b'', initial_value=message[:AES.block_size])
+            return aes.decrypt(message[AES.block_size:])
         aes = AES.new(key, AES.MODE_CBC, iv=b'\0' * 16)
         return unpad(aes.decrypt(message), AES.block_size)
     except Exception as e:
         print(e)
         return None
+
+
+def decrypt_file(key, source, write, mode=ECipherMode.CBC, block_size=1 << 16):
+    """ Decrypt the content of a file object a block at a time, passing the plain text to write.
+    In CBC the last block is held back until its padding is removed. """
+    try:
+        source.seek(0)
+        if mode == ECipherMode.CTR:
+            aes = AES.new(key, AES.MODE_CTR, nonce=b'', initial_value=source.read(AES.block_size))
+            while data := source.read(block_size):
+                write(aes.decrypt(data))
+            return True
+
+        aes = AES.new(key, AES.MODE_CBC, iv=b'\0' * 16)
+        previous = b""
+        while data := source.read(block_size):
+            if previous:
+                write(previous)
+            previous = aes.decrypt(data)
+        write(unpad(previous, AES.block_size))
+        return True
+    except Exception as e:
+        print(e)
+        return False
+
+
+def open_sealed_packet(key, packet_number, sealed):
+    """ Authenticate and decrypt a GCM packet, its nonce, cipher text and tag, along with its packet number.
+    Returns None when it doesn't authenticate. """
+    try:
+        aes = AES.new(key, AES.MODE_GCM, nonce=sealed[:GCM_NONCE_SIZE], mac_len=GCM_TAG_SIZE)
+        aes.update(struct.pack("<Q", packet_number))
+        return aes.decrypt_and_verify(sealed[GCM_NONCE_SIZE:-GCM_TAG_SIZE], sealed[-GCM_TAG_SIZE:])
+    except (ValueError, KeyError):
+        return None
+
+
+def resumption_secret(aes_key):
+    """ The secret a session's ticket carries, the key of the session resumed with it is derived from it """
+    return HKDF(aes_key, AES.block_size, None, SHA256, context=RESUMPTION_INFO)
+
+
+def resumed_aes_key(secret, nonce):
+    return HKDF(secret, AES.block_size, nonce, SHA256, context=RESUMED_KEY_INFO)
+
+
+def transfer_key(aes_key, salt):
+    """ The key an open transfer's content is encrypted with, so that no two files or attempts share one """
+    return HKDF(aes_key, AES.block_size, salt, SHA256, context=TRANSFER_KEY_INFO)
+
+
+def seal_ticket(ticket_key, client_id, secret, expiry):
+    """ Seal the client ID, resumption secret and expiry under the server's ticket key, opaque to the client """
+    aes = AES.new(ticket_key, AES.MODE_GCM, nonce=get_random_bytes(TICKET_NONCE_SIZE))
+    sealed, tag = aes.encrypt_and_digest(client_id + secret + struct.pack("<Q", expiry))
+    return aes.nonce + sealed + tag
+
+
+def open_ticket(ticket_key, ticket):
+    """ Returns the client ID, resumption secret and expiry of a ticket, or None if it wasn't sealed by us """
+    try:
+        aes = AES.new(ticket_key, AES.MODE_GCM, nonce=ticket[:TICKET_NONCE_SIZE])
+        content = aes.decrypt_and_verify(ticket[TICKET_NONCE_SIZE:-AES.block_size], ticket[-AES.block_size:])
+        client_id, secret = content[:16], content[16:32]
+        return client_id, secret, struct.unpack("<Q", content[32:40])[0]
+    except (ValueError, KeyError, struct.error):
+        return None
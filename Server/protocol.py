@@ -1,24 +1,65 @@
+import copy
 import struct
 
 from enum import Enum
 
-SERVER_VERSION = 3
+SERVER_VERSION = 14
+WINDOWED_ACK_VERSION = 4  # File packets are acknowledged with their packet number.
+LARGE_FILE_VERSION = 5  # File packets with 64-bit sizes and packet numbers.
+CIPHER_MODE_VERSION = 6  # File packets tell their cipher mode, negotiated in CAPABILITIES.
+KEY_AGREEMENT_VERSION = 7  # The AES key is agreed on with X25519 instead of sent with RSA.
+RESUMPTION_VERSION = 8  # Reconnections may resume a session with a ticket, skipping the key exchange.
+COMBINED_REGISTRATION_VERSION = 9  # New clients register and agree on the AES key in one request.
+COMPACT_FILE_VERSION = 10  # A file is described once when opened, its packets carry only content.
+FRAME_SIZE_VERSION = 11  # Requests longer than PACKET_SIZE, up to a frame size negotiated in CAPABILITIES.
+EXACT_FRAME_VERSION = 12  # Requests and their responses are framed by their header's payload size, unpadded.
+STRIPED_VERSION = 13  # An open transfer's packets may arrive over several connections, in any order.
+TRANSFER_KEY_VERSION = 14  # An open transfer's content is encrypted with a key derived for it.
 DEF_VAL = 0  # Default value to initialize inner fields.
 HEADER_WITHOUT_CLIENT_ID = 7  # Header size without client ID.(version, code, payload size).
 CLIENT_ID_SIZE = 16
 HEADER_SIZE = CLIENT_ID_SIZE + HEADER_WITHOUT_CLIENT_ID
+RESPONSE_HEADER_SIZE = HEADER_WITHOUT_CLIENT_ID
 ACTUAL_NAME_SIZE = 100
 NAME_SIZE = 255
 PUBLIC_KEY_SIZE = 160
+AGREEMENT_KEY_SIZE = 32  # X25519 public key.
+KEY_SALT_SIZE = 16
+TICKET_SIZE = 68  # nonce, sealed client ID, resumption secret and expiry, tag.
+RESUMPTION_NONCE_SIZE = 16
+TICKET_LIFETIME = 24 * 60 * 60  # Seconds a session ticket can be used for.
 PACKET_SIZE = 1024  # Default packet size.
+MAX_FRAME_SIZE = 1 << 20  # The largest request frame the server accepts.
+FRAME_SIZE_FIELD_SIZE = 4
 MAX_QUEUED_CONN = 5  # Default maximum number of queued connections.
+WINDOW_SIZE = 16  # Default file packets a client may keep in flight.
+COMPLETED_TRANSFERS_KEPT = 16  # Completed transfers of a client whose packets are answered when sent again.
+WINDOW_FIELD_SIZE = 2
+CIPHER_MODES_SIZE = 1
 CONTENT_SIZE = 4
 ORIG_FILE_SIZE = 4
 PACKET_NUMBER_SIZE = 2
 TOTAL_PACKETS_SIZE = 2
+LARGE_CONTENT_SIZE = 8  # Content sizes, packet numbers and counts of the large file layout.
+LARGE_PACKET_NUMBER_SIZE = 8
+TRANSFER_ID_SIZE = 4
+FILE_DATA_PREFIX_SIZE = HEADER_SIZE + TRANSFER_ID_SIZE + LARGE_PACKET_NUMBER_SIZE  # Before a compact packet's content.
 FILE_NAME_SIZE = 255
 CHUNK_SIZE = 32
 CRC_SIZE = 4
+GCM_NONCE_SIZE = 12  # A CIPHER_GCM packet is its nonce, cipher text and tag.
+GCM_TAG_SIZE = 16
+SEALED_OVERHEAD = GCM_NONCE_SIZE + GCM_TAG_SIZE
+
+
+# How the file's content is encrypted
+class ECipherMode(Enum):
+    CBC = 0  # zero IV, PKCS#7 padded. The only mode before CIPHER_MODE_VERSION.
+    CTR = 1  # random IV in the content's first 16 bytes.
+    GCM = 2  # every packet sealed on its own, no CRC exchange afterwards.
+
+
+CIPHER_MODE_PREFERENCE = [ECipherMode.GCM, ECipherMode.CTR, ECipherMode.CBC]
 
 
 # Request Code
@@ -27,6 +68,13 @@ class ERequestCode(Enum):
     SENDING_PUBLIC_KEY = 826
     RECONNECTION = 827
     SENDING_FILE = 828
+    CAPABILITIES = 829  # uuid ignored.
+    SENDING_AGREEMENT_KEY = 830  # like 826, with an X25519 public key.
+    REQUEST_TICKET = 831  # payload is empty.
+    RESUMPTION = 832  # like 827, with the ticket of a previous session.
+    REGISTRATION_WITH_KEY = 833  # like 830 with the uuid ignored, answered by 1611 or 1601.
+    OPEN_TRANSFER = 834  # like 828 without content, answered by 1613.
+    SENDING_FILE_DATA = 835  # a packet of an open transfer, answered like 828.
     CRC_VALID = 900
     CRC_INVALID_SENDING_AGAIN = 901
     CRC_INVALID_FORTH_TIME_IM_DONE = 902
@@ -42,6 +90,33 @@ class EResponseCode(Enum):
     APPROVED_REQUEST_TO_RECONNECT_SENDING_AES = 1605  # table identical to code 1602
     REQUEST_FOR_RECONNECTION_DENIED = 1606  # client is not registered, or invalid public key
     GENERIC_ERROR = 1607  # payload invalid. payloadSize = 0.
+    SERVER_CAPABILITIES = 1608
+    APPROVED_GETTING_PACKET_THANKS = 1609  # like 1604, with the acknowledged packet number.
+    PACKET_REJECTED = 1610  # a GCM packet failed authentication, with its packet number.
+    AGREED_ON_AES_KEY = 1611  # like 1602 and 1605, for clients with an X25519 key.
+    SESSION_TICKET = 1612  # a ticket to resume the session with, also approves a resumption.
+    TRANSFER_OPENED = 1613  # the id the file's packets are sent with.
+
+
+def frame_size(data):
+    """ Size of the request frame that data starts with, its header must be there already.
+    Requests are padded to PACKET_SIZE, from FRAME_SIZE_VERSION a longer one is sent whole
+    and from EXACT_FRAME_VERSION a shorter one isn't padded. """
+    version = data[CLIENT_ID_SIZE]
+    payload_size = struct.unpack_from("<I", data, CLIENT_ID_SIZE + 3)[0]
+    if version < FRAME_SIZE_VERSION:
+        return PACKET_SIZE
+    if version < EXACT_FRAME_VERSION:
+        return max(PACKET_SIZE, HEADER_SIZE + payload_size)
+    return HEADER_SIZE + payload_size
+
+
+def response_frame_size(data, exact):
+    """ Size of the frame a packed response is sent in, padded to PACKET_SIZE frames
+    or exactly its header and the payload it announces. """
+    if exact:
+        return RESPONSE_HEADER_SIZE + struct.unpack_from("<L", data, 3)[0]
+    return -(-len(data) // PACKET_SIZE) * PACKET_SIZE
 
 
 class RequestHeader:
@@ -163,6 +238,87 @@ class ResponseEncryptedAES:
             return b""
 
 
+class SendingAgreementKey(SendingPublicKey):
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, name and X25519 public key """
+        try:
+            name_data = data[HEADER_SIZE:HEADER_SIZE + NAME_SIZE]
+            self.name = str(struct.unpack(
+                f"<{NAME_SIZE}s", name_data)[0].partition(b'\0')[0].decode('utf-8'))
+
+            key_data = data[HEADER_SIZE + NAME_SIZE:HEADER_SIZE + NAME_SIZE + AGREEMENT_KEY_SIZE]
+            self.public_key = struct.unpack(f"<{AGREEMENT_KEY_SIZE}s", key_data)[0]
+            return True
+        except:
+            self.__init__(b"")
+            return False
+
+
+class ResponseAgreedKey:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.AGREED_ON_AES_KEY.value)
+        self.client_ID = b""
+        self.public_key = b""
+        self.salt = b""
+
+    def payload_size(self):
+        return CLIENT_ID_SIZE + AGREEMENT_KEY_SIZE + KEY_SALT_SIZE
+
+    def pack(self):
+        """ Little Endian pack Response Header, client ID, the server's X25519 public key and the salt """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.client_ID)
+            data += struct.pack(f"<{AGREEMENT_KEY_SIZE}s", self.public_key)
+            data += struct.pack(f"<{KEY_SALT_SIZE}s", self.salt)
+            return data
+        except:
+            return b""
+
+
+class ResumptionRequest(ConnectionRequest):
+    def __init__(self, request_header):
+        super().__init__(request_header)
+        self.ticket = b""
+        self.nonce = b""
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, name, session ticket and nonce """
+        try:
+            if not super().unpack(data):
+                return False
+            offset = HEADER_SIZE + NAME_SIZE
+            self.ticket = data[offset:offset + TICKET_SIZE]
+            offset += TICKET_SIZE
+            self.nonce = data[offset:offset + RESUMPTION_NONCE_SIZE]
+            return len(self.ticket) == TICKET_SIZE and len(self.nonce) == RESUMPTION_NONCE_SIZE
+        except:
+            self.__init__(b"")
+            return False
+
+
+class ResponseSessionTicket:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.SESSION_TICKET.value)
+        self.client_ID = b""
+        self.lifetime = DEF_VAL
+        self.ticket = b""
+
+    def payload_size(self):
+        return CLIENT_ID_SIZE + 4 + TICKET_SIZE
+
+    def pack(self):
+        """ Little Endian pack Response Header, client ID, the ticket's lifetime and the ticket """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.client_ID)
+            data += struct.pack("<I", self.lifetime)
+            data += struct.pack(f"<{TICKET_SIZE}s", self.ticket)
+            return data
+        except:
+            return b""
+
+
 class RequestSendingFile:
     class Packets:
         def __init__(self):
@@ -174,33 +330,51 @@ class RequestSendingFile:
         self.content_size = b""
         self.orig_file_size = b""
         self.packets = RequestSendingFile.Packets()
+        self.cipher_mode = ECipherMode.CBC
         self.file_name = b""
         self.message_content = b""
+        self.chunk_size = DEF_VAL  # Content carried by every packet but the last.
+        self.content_key = None  # An open transfer's own key, the session's key is used otherwise.
+
+    def is_large(self):
+        return self.header.version >= LARGE_FILE_VERSION
 
     def unpack(self, data):
-        """ Little Endian unpack Request Header and Registration data """
+        """ Little Endian unpack Request Header and Registration data.
+        The header's version tells whether sizes and packet numbers are of the large file layout. """
         try:
             # we use offset to get past each field
             if not self.header.unpack(data):
                 return False
+            if self.is_large():
+                size_format, size_length = "<Q", LARGE_CONTENT_SIZE
+                number_format, number_length = "<Q", LARGE_PACKET_NUMBER_SIZE
+            else:
+                size_format, size_length = "<I", CONTENT_SIZE
+                number_format, number_length = "<H", PACKET_NUMBER_SIZE
             offset = HEADER_SIZE
-            self.content_size = struct.unpack("<I", data[offset:offset + CONTENT_SIZE])[0]
-            offset += CONTENT_SIZE
+            self.content_size = struct.unpack(size_format, data[offset:offset + size_length])[0]
+            offset += size_length
+
+            self.orig_file_size = struct.unpack(size_format, data[offset:offset + size_length])[0]
+            offset += size_length
 
-            self.orig_file_size = struct.unpack("<I", data[offset:offset + ORIG_FILE_SIZE])[0]
-            offset += ORIG_FILE_SIZE
+            self.packets.packet_number = struct.unpack(number_format, data[offset:offset + number_length])[0]
+            offset += number_length
 
-            self.packets.packet_number = struct.unpack("<H", data[offset:offset + PACKET_NUMBER_SIZE])[0]
-            offset += PACKET_NUMBER_SIZE
+            self.packets.total_packets = struct.unpack(number_format, data[offset:offset + number_length])[0]
+            offset += number_length
 
-            self.packets.total_packets = struct.unpack("<H", data[offset:offset + TOTAL_PACKETS_SIZE])[0]
-            offset += TOTAL_PACKETS_SIZE
+            if self.header.version >= CIPHER_MODE_VERSION:
+                self.cipher_mode = ECipherMode(data[offset])
+                offset += CIPHER_MODES_SIZE
 
             file_name_data = data[offset:offset + FILE_NAME_SIZE]
             self.file_name = str(struct.unpack(
                 f"<{FILE_NAME_SIZE}s", file_name_data)[0].partition(b'\0')[0].decode('utf-8'))
             offset += FILE_NAME_SIZE
 
+            self.chunk_size = PACKET_SIZE - offset
             self.message_content = data[offset:HEADER_SIZE + self.header.payload_size]
             return True
         except:
@@ -229,20 +403,112 @@ class RequestSendingFile:
         return ""
 
 
-class ReceivedValidFileWithCRC:
+class OpenTransferRequest(RequestSendingFile):
+    """ The description of a file sent in compact packets, every packet is handled as a RequestSendingFile of it. """
     def __init__(self):
+        super().__init__()
+        self.frame_size = PACKET_SIZE  # Of every packet but the last.
+        self.salt = None  # From TRANSFER_KEY_VERSION, the transfer's key is derived with it.
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, sizes, total packets, cipher mode and file name """
+        try:
+            if not self.header.unpack(data):
+                return False
+            offset = HEADER_SIZE
+            self.content_size, self.orig_file_size, self.packets.total_packets = \
+                struct.unpack("<QQQ", data[offset:offset + 3 * LARGE_CONTENT_SIZE])
+            offset += 3 * LARGE_CONTENT_SIZE
+
+            self.cipher_mode = ECipherMode(data[offset])
+            offset += CIPHER_MODES_SIZE
+
+            file_name_data = data[offset:offset + FILE_NAME_SIZE]
+            self.file_name = str(struct.unpack(
+                f"<{FILE_NAME_SIZE}s", file_name_data)[0].partition(b'\0')[0].decode('utf-8'))
+            offset += FILE_NAME_SIZE
+
+            if self.header.version >= FRAME_SIZE_VERSION:
+                self.frame_size = struct.unpack("<I", data[offset:offset + FRAME_SIZE_FIELD_SIZE])[0]
+                offset += FRAME_SIZE_FIELD_SIZE
+
+            if self.header.version >= TRANSFER_KEY_VERSION:
+                self.salt = data[offset:offset + KEY_SALT_SIZE]
+                if len(self.salt) != KEY_SALT_SIZE:
+                    return False
+            self.chunk_size = self.frame_size - FILE_DATA_PREFIX_SIZE
+            return True
+        except:
+            self.__init__()
+            return False
+
+    def packet(self, file_data):
+        """ The request of one of the transfer's packets """
+        request = copy.copy(self)
+        request.packets = RequestSendingFile.Packets()
+        request.packets.packet_number = file_data.packet_number
+        request.packets.total_packets = self.packets.total_packets
+        request.message_content = file_data.message_content
+        return request
+
+
+class RequestSendingFileData:
+    def __init__(self, request_header):
+        self.header = request_header
+        self.transfer_id = DEF_VAL
+        self.packet_number = DEF_VAL
+        self.message_content = b""
+
+    def unpack(self, data):
+        """ Little Endian unpack Request Header, transfer ID, packet number and content """
+        try:
+            self.transfer_id, self.packet_number = \
+                struct.unpack("<IQ", data[HEADER_SIZE:FILE_DATA_PREFIX_SIZE])
+            self.message_content = data[FILE_DATA_PREFIX_SIZE:HEADER_SIZE + self.header.payload_size]
+            return True
+        except:
+            self.__init__(self.header)
+            return False
+
+
+class ResponseTransferOpened:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.TRANSFER_OPENED.value)
+        self.client_ID = b""
+        self.transfer_id = DEF_VAL
+
+    def payload_size(self):
+        return CLIENT_ID_SIZE + TRANSFER_ID_SIZE
+
+    def pack(self):
+        """ Little Endian pack Response Header, client ID and transfer ID """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.client_ID)
+            data += struct.pack("<I", self.transfer_id)
+            return data
+        except:
+            return b""
+
+
+class ReceivedValidFileWithCRC:
+    def __init__(self, large=False):
         self.header = ResponseHeader(EResponseCode.FILE_RECEIVED_PROPERLY_WITH_CRC.value)
+        self.large = large  # 64-bit content size, in reply to a large file layout request.
         self.client_ID = b""
         self.content_size = b""
         self.file_name = b""
         self.crc = b""
 
+    def payload_size(self):
+        return CLIENT_ID_SIZE + (LARGE_CONTENT_SIZE if self.large else CONTENT_SIZE) + FILE_NAME_SIZE + CRC_SIZE
+
     def pack(self):
         """ Little Endian pack Response Header and client ID """
         try:
             data = self.header.pack()
             data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.client_ID)
-            data += struct.pack("<L", self.content_size)
+            data += struct.pack("<Q" if self.large else "<L", self.content_size)
             data += struct.pack(f"<{FILE_NAME_SIZE}s", self.file_name)
             data += struct.pack("<L", self.crc)
             return data
@@ -290,3 +556,80 @@ class ResponseMessage:
             return data
         except:
             return b""
+
+
+class ResponsePacketReceived:
+    def __init__(self, large=False):
+        self.header = ResponseHeader(EResponseCode.APPROVED_GETTING_PACKET_THANKS.value)
+        self.large = large  # 64-bit packet number, in reply to a large file layout request.
+        self.client_ID = b""
+        self.packet_number = DEF_VAL
+
+    def payload_size(self):
+        return CLIENT_ID_SIZE + (LARGE_PACKET_NUMBER_SIZE if self.large else PACKET_NUMBER_SIZE)
+
+    def pack(self):
+        """ Little Endian pack Response Header, client ID and packet number """
+        try:
+            data = self.header.pack()
+            data += struct.pack(f"<{CLIENT_ID_SIZE}s", self.client_ID)
+            data += struct.pack("<Q" if self.large else "<H", self.packet_number)
+            return data
+        except:
+            return b""
+
+
+class ResponsePacketRejected(ResponsePacketReceived):
+    def __init__(self):
+        super().__init__(large=True)
+        self.header = ResponseHeader(EResponseCode.PACKET_REJECTED.value)
+
+
+class CapabilitiesRequest:
+    def __init__(self, request_header):
+        self.header = request_header
+        self.window_size = DEF_VAL
+        self.cipher_modes = [ECipherMode.CBC]
+        self.frame_size = PACKET_SIZE
+
+    def unpack(self, data):
+        """ Little Endian unpack the window the client would use, from CIPHER_MODE_VERSION its cipher modes
+        and from FRAME_SIZE_VERSION the largest frame it would send """
+        try:
+            window_data = data[HEADER_SIZE:HEADER_SIZE + WINDOW_FIELD_SIZE]
+            self.window_size = struct.unpack("<H", window_data)[0]
+            if self.header.version >= CIPHER_MODE_VERSION:
+                modes = data[HEADER_SIZE + WINDOW_FIELD_SIZE]
+                self.cipher_modes = [mode for mode in ECipherMode if modes & (1 << mode.value)]
+            if self.header.version >= FRAME_SIZE_VERSION:
+                offset = HEADER_SIZE + WINDOW_FIELD_SIZE + CIPHER_MODES_SIZE
+                self.frame_size = struct.unpack("<I", data[offset:offset + FRAME_SIZE_FIELD_SIZE])[0]
+            return True
+        except:
+            self.__init__(b"")
+            return False
+
+
+class ResponseCapabilities:
+    def __init__(self):
+        self.header = ResponseHeader(EResponseCode.SERVER_CAPABILITIES.value)
+        self.window_size = DEF_VAL
+        self.cipher_mode = None  # only answered to clients of CIPHER_MODE_VERSION
+        self.frame_size = None  # only answered to clients of FRAME_SIZE_VERSION
+
+    def payload_size(self):
+        return WINDOW_FIELD_SIZE + (CIPHER_MODES_SIZE if self.cipher_mode is not None else 0) + \
+            (FRAME_SIZE_FIELD_SIZE if self.frame_size is not None else 0)
+
+    def pack(self):
+        """ Little Endian pack Response Header, the agreed window, cipher mode and frame size """
+        try:
+            data = self.header.pack()
+            data += struct.pack("<H", self.window_size)
+            if self.cipher_mode is not None:
+                data += struct.pack("<B", self.cipher_mode.value)
+            if self.frame_size is not None:
+                data += struct.pack("<I", self.frame_size)
+            return data
+        except:
+            return b""
@@ -1,7 +1,9 @@
+import itertools
 import logging
 import re
 import selectors
 import socket
+import time
 import uuid
 from functools import partial
 
@@ -14,14 +16,18 @@ import utils
 
 class Server:
     PACKET_SIZE = 1024  # Default packet size.
-    MAX_QUEUED_CONN = 5  # Default maximum number of queued connections.
+    RECEIVE_SIZE = 1 << 16  # Bytes read at a time, a frame may be longer than PACKET_SIZE.
+    MAX_PENDING_REPLIES = 1 << 20  # Bytes of replies a client hasn't read yet, before its requests stop being read.
+    MAX_QUEUED_CONN = 128  # Connections queued before accepted, an agent opens many at once.
     IS_BLOCKED = False
 
-    def __init__(self, host, port):
+    def __init__(self, host, port, window_size=protocol.WINDOW_SIZE, max_frame_size=protocol.MAX_FRAME_SIZE):
         logging.basicConfig(level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
 
         self.host = host
         self.port = port
+        self.window_size = window_size  # File packets a client may keep in flight.
+        self.max_frame_size = max(protocol.PACKET_SIZE, max_frame_size)  # The longest request a client may send.
         self.sel = selectors.DefaultSelector()
         self.request_handle = {
             # We are using partial() to make a new function where 'self' is already tied to each function
@@ -29,12 +35,24 @@ class Server:
             protocol.ERequestCode.SENDING_PUBLIC_KEY.value: partial(self.handle_public_key_request),
             protocol.ERequestCode.RECONNECTION.value: partial(self.handle_reconnection),
             protocol.ERequestCode.SENDING_FILE.value: partial(self.handle_sending_file),
+            protocol.ERequestCode.CAPABILITIES.value: partial(self.handle_capabilities),
+            protocol.ERequestCode.SENDING_AGREEMENT_KEY.value: partial(self.handle_agreement_key_request),
+            protocol.ERequestCode.REQUEST_TICKET.value: partial(self.handle_ticket_request),
+            protocol.ERequestCode.RESUMPTION.value: partial(self.handle_resumption),
+            protocol.ERequestCode.REGISTRATION_WITH_KEY.value: partial(self.handle_registration_with_key),
+            protocol.ERequestCode.OPEN_TRANSFER.value: partial(self.handle_open_transfer),
+            protocol.ERequestCode.SENDING_FILE_DATA.value: partial(self.handle_sending_file_data),
             protocol.ERequestCode.CRC_VALID.value: partial(self.handle_message),
             protocol.ERequestCode.CRC_INVALID_SENDING_AGAIN.value: partial(self.handle_message),
             protocol.ERequestCode.CRC_INVALID_FORTH_TIME_IM_DONE.value: partial(self.handle_message)
         }
         self.client_list = []
         self.client_aes_ciphers = {}
+        self.ticket_key = keys.AESCipher().key  # Seals session tickets, they don't outlive the server.
+        self.transfer_ids = itertools.count(1)
+        self.connections = {}  # Receive buffer of each open connection.
+        self.replies = {}  # Replies of each open connection its client hasn't read yet.
+        self.exact_replies = False  # The request being handled is answered unpadded.
 
     def start(self):
         try:
@@ -65,56 +83,142 @@ class Server:
         conn, addr = sock.accept()
         logging.info(f"Accepted connection from {addr}")
         conn.setblocking(False)
-        self.sel.register(conn, selectors.EVENT_READ, self.read)
-
-    def read(self, conn, mask):
-        data = conn.recv(self.PACKET_SIZE)
-        success = False
-        # Debug::
-        logging.info(f"Received request: {data}")
-        if data:
-            request_header = protocol.RequestHeader()
-            if not request_header.unpack(data):
-                logging.error("Failed to parse request header!")
-                logging.error(f"Sending a generic error code: "
-                              f"{protocol.EResponseCode.GENERIC_ERROR.value}")
-                response_header = protocol.ResponseHeader(protocol.EResponseCode.GENERIC_ERROR.value)
-                self.write(conn, response_header.pack())
-            else:
-                if request_header.code in self.request_handle.keys():
-                    # invoke corresponding handle.
-                    success = self.request_handle[request_header.code](conn, data, request_header)
-                if not success:
-                    logging.error(f"Sending a generic error code: "
-                                  f"{protocol.EResponseCode.GENERIC_ERROR.value}")
-                    response_header = protocol.ResponseHeader(protocol.EResponseCode.GENERIC_ERROR.value)
-                    self.write(conn, response_header.pack())
+        self.connections[conn] = bytearray()
+        self.replies[conn] = bytearray()
+        self.sel.register(conn, selectors.EVENT_READ, self.ready)
+
+    def ready(self, conn, mask):
+        """ Send what's left of the replies once the connection takes more, and read its requests. """
+        if mask & selectors.EVENT_WRITE and not self.flush(conn):
+            self.close(conn)
+            return
+        if mask & selectors.EVENT_READ:
+            self.read(conn)
+
+    def read(self, conn):
+        """ Buffer incoming data and handle every complete request.
+        The connection stays open for further requests until the client closes it. """
+        try:
+            data = conn.recv(self.RECEIVE_SIZE)
+        except BlockingIOError:
+            return
+        except OSError as err:
+            logging.error(f"Failed receiving from {conn}: {err}")
+            data = b""
+
+        if not data:
+            self.close(conn)
+            return
+
+        buffer = self.connections[conn]
+        buffer += data
+        while len(buffer) >= protocol.HEADER_SIZE:
+            frame_size = protocol.frame_size(buffer)
+            if frame_size > self.max_frame_size:
+                logging.error(f"Request of {frame_size} bytes from {conn} exceeds the frame size, dropping it")
+                self.close(conn)
+                return
+            if len(buffer) < frame_size:
+                break
+            request = bytes(buffer[:frame_size])
+            del buffer[:frame_size]
+            self.handle_request(conn, request)
 
+    def close(self, conn):
         logging.info(f"Closing connection to {conn}")
+        self.connections.pop(conn, None)
+        self.replies.pop(conn, None)
         self.sel.unregister(conn)
         conn.close()
 
-    @staticmethod
-    def write(conn, data):
-        """ Send a response to client"""
-        size = len(data)
-        sent = 0
-        while sent < size:
-            leftover = size - sent
-            if leftover > Server.PACKET_SIZE:
-                leftover = Server.PACKET_SIZE
-            to_send = data[sent:sent + leftover]
-            if len(to_send) < Server.PACKET_SIZE:
-                to_send += bytearray(Server.PACKET_SIZE - len(to_send))
-            try:
-                conn.send(to_send)
-                sent += len(to_send)
-            except:
-                logging.error("Failed to send response to " + conn)
-                return False
+    def flush(self, conn):
+        """ Send as much of the pending replies as the connection takes without blocking, and wait for it to
+        take the rest. A client that doesn't read its replies has its requests left unread meanwhile, so it
+        doesn't hold up the other connections. False when the connection failed. """
+        pending = self.replies[conn]
+        try:
+            while pending:
+                sent = conn.send(pending)
+                del pending[:sent]
+        except BlockingIOError:
+            pass
+        except OSError as err:
+            logging.error(f"Failed to send response to {conn}: {err}")
+            return False
+
+        events = selectors.EVENT_WRITE if pending else selectors.EVENT_READ
+        if pending and len(pending) < self.MAX_PENDING_REPLIES:
+            events |= selectors.EVENT_READ
+        if self.sel.get_key(conn).events != events:
+            self.sel.modify(conn, events, self.ready)
+        return True
+
+    def handle_request(self, conn, data):
+        """ Parse a single request and invoke its handle, replying a generic error on failure. """
+        success = False
+        # Debug::
+        logging.info(f"Received request: {data[:protocol.HEADER_SIZE]}")
+        request_header = protocol.RequestHeader()
+        self.exact_replies = False
+        if not request_header.unpack(data):
+            logging.error("Failed to parse request header!")
+            logging.error(f"Sending a generic error code: "
+                          f"{protocol.EResponseCode.GENERIC_ERROR.value}")
+            response_header = protocol.ResponseHeader(protocol.EResponseCode.GENERIC_ERROR.value)
+            self.write(conn, response_header.pack())
+            return
+
+        # Clients of EXACT_FRAME_VERSION read unpadded responses, but for CAPABILITIES
+        # that tells them the server's version, before they know how its responses are framed
+        self.exact_replies = request_header.version >= protocol.EXACT_FRAME_VERSION and \
+            request_header.code != protocol.ERequestCode.CAPABILITIES.value
+        if request_header.code in self.request_handle.keys():
+            # invoke corresponding handle.
+            success = self.request_handle[request_header.code](conn, data, request_header)
+        if not success:
+            logging.error(f"Sending a generic error code: "
+                          f"{protocol.EResponseCode.GENERIC_ERROR.value}")
+            response_header = protocol.ResponseHeader(protocol.EResponseCode.GENERIC_ERROR.value)
+            self.write(conn, response_header.pack())
+
+    def write(self, conn, data):
+        """ Send a response to client, padded to PACKET_SIZE frames unless the request is answered exactly """
+        if self.exact_replies and len(data) < protocol.RESPONSE_HEADER_SIZE:
+            logging.error(f"Failed to pack a response to {conn}")
+            return False
+        if conn not in self.replies:
+            logging.error(f"Failed to send response to {conn}, the connection is closed")
+            return False
+        size = protocol.response_frame_size(data, self.exact_replies)
+        # queued behind the replies not sent yet, a pipelining client may not read its replies right away
+        self.replies[conn] += bytes(data[:size]).ljust(size, b'\0')
+        if not self.flush(conn):
+            self.replies[conn].clear()
+            return False
         logging.info("Response sent successfully.")
         return True
 
+    def handle_capabilities(self, conn, data, request_header):
+        """ Advertise the server's version, agree on a window of file packets in flight, a cipher mode
+        and the size of the frames file packets may fill. """
+        request = protocol.CapabilitiesRequest(request_header)
+        response = protocol.ResponseCapabilities()
+
+        if not request.unpack(data):
+            logging.error("Capabilities Request: Failed parsing request.")
+            return False
+
+        response.window_size = max(1, min(request.window_size, self.window_size))
+        if request.header.version >= protocol.CIPHER_MODE_VERSION:
+            response.cipher_mode = next((mode for mode in protocol.CIPHER_MODE_PREFERENCE
+                                         if mode in request.cipher_modes), protocol.ECipherMode.CBC)
+        if request.header.version >= protocol.FRAME_SIZE_VERSION:
+            response.frame_size = max(protocol.PACKET_SIZE, min(request.frame_size, self.max_frame_size))
+        response.header.payload_size = response.payload_size()
+        logging.info(f"Agreed on a window of {response.window_size} packets, cipher mode {response.cipher_mode},"
+                     f" frames of {response.frame_size or protocol.PACKET_SIZE} bytes.")
+        return self.write(conn, response.pack())
+
     def handle_registration(self, conn, data, requestHeader):
         """ Register a new user. """
         request = protocol.ConnectionRequest(requestHeader)
@@ -125,35 +229,58 @@ class Server:
             logging.error("Registration Request: Failed parsing request.")
             return False
 
-        if not bool(re.match(r'^[a-zA-Z0-9 ]+$', request.name)):
-            logging.error(f"Registration Request: Invalid requested username ({request.name})) "
-                          f"must be of [a-zA-Z0-9 ] expression")
+        client, success = self.register(conn, request.name)
+        if not client:
+            return success
+
+        # Send successful response
+        response.client_ID = client.id
+        response.header.payload_size = protocol.CLIENT_ID_SIZE
+        return self.write(conn, response.pack())
+
+    def handle_registration_with_key(self, conn, data, requestHeader):
+        """ Register a new user and agree on an aes key with its X25519 key, in a single round trip. """
+        request = protocol.SendingAgreementKey(requestHeader)
+
+        if not request.unpack(data):
+            logging.error("Registration with key Request: Failed parsing request.")
             return False
-        if len(request.name) > protocol.ACTUAL_NAME_SIZE:
-            logging.error(f"Registration Request: Invalid requested username ({request.name})) "
+
+        client, success = self.register(conn, request.name)
+        if not client:
+            return success
+
+        client.public_key = request.public_key
+        return self.send_agreed_key(conn, client)
+
+    def register(self, conn, name):
+        """ Add a client with a new username. Returns the client, or None and whether the request was answered. """
+        if not bool(re.match(r'^[a-zA-Z0-9 ]+$', name)):
+            logging.error(f"Registration Request: Invalid requested username ({name})) "
+                          f"must be of [a-zA-Z0-9 ] expression")
+            return None, False
+        if len(name) > protocol.ACTUAL_NAME_SIZE:
+            logging.error(f"Registration Request: Invalid requested username ({name})) "
                           f"must be {protocol.ACTUAL_NAME_SIZE} chars at most")
-            return False
+            return None, False
 
         # Handle if failed registration:
         for client in self.client_list:
-            if request.name == client.name:
+            if name == client.name:
                 logging.error(f"Registration Request: Client is already registered")
+                response = protocol.ResponseClientID()
                 response.header.code = protocol.EResponseCode.REGISTRATION_FAILED.value
-                return self.write(conn, response.pack())
+                return None, self.write(conn, response.pack())
 
         # Handle successful registration
         try:
-            client = client_model.Client(uuid.uuid4().hex, request.name)
+            client = client_model.Client(uuid.uuid4().hex, name)
         except:
-            logging.error(f"Registration Request: Error creating uuid for client's username: {request.name} ")
-            return False
+            logging.error(f"Registration Request: Error creating uuid for client's username: {name} ")
+            return None, False
         self.client_list.append(client)  # save the client on the RAM
-        logging.info(f"Successfully registered client {request.name}.")
-
-        # Send successful response
-        response.client_ID = client.id
-        response.header.payload_size = protocol.CLIENT_ID_SIZE
-        return self.write(conn, response.pack())
+        logging.info(f"Successfully registered client {name}.")
+        return client, True
 
     def handle_public_key_request(self, conn, data, requestHeader):
         request = protocol.SendingPublicKey(requestHeader)
@@ -203,6 +330,54 @@ class Server:
         logging.info(f"Successfully received public key and sending aes.")
         return self.write(conn, response.pack())
 
+    def handle_agreement_key_request(self, conn, data, requestHeader):
+        request = protocol.SendingAgreementKey(requestHeader)
+
+        # Handle sending agreement key failure:
+        if not request.unpack(data):
+            logging.error("Sending agreement key Request: Failed parsing request.")
+            return False
+
+        # Handle if not registered:
+        is_registered = False
+        this_client = None
+        for client in self.client_list:
+            if request.name == client.name:
+                is_registered = True
+                this_client = client  # found a matching client
+                break
+
+        if not is_registered:
+            logging.error(f"Sending agreement key Request: Invalid requested username ({request.name})) "
+                          "is not registered")
+            return False
+
+        if this_client.id != request.header.client_id:
+            logging.error(f"Sending agreement key Request: Invalid requested id ({request.header.client_id})) "
+                          f"is not registered to this username ({request.name})")
+            return False
+
+        # Save the public key, and agree on an aes key with it
+        this_client.public_key = request.public_key
+        return self.send_agreed_key(conn, this_client)
+
+    def send_agreed_key(self, conn, this_client):
+        """ Agree on a new aes key with the client's X25519 key, and send the server's half of the agreement. """
+        agreement = keys.agree_on_aes_key(this_client.public_key)
+        if not agreement:
+            logging.error(f"Key agreement with client ({this_client.id}) failed")
+            return False
+        aes_cipher, public_key, salt = agreement
+        self.client_aes_ciphers[this_client] = aes_cipher
+
+        response = protocol.ResponseAgreedKey()
+        response.client_ID = this_client.id
+        response.public_key = public_key
+        response.salt = salt
+        response.header.payload_size = response.payload_size()
+        logging.info(f"Successfully agreed on aes key.")
+        return self.write(conn, response.pack())
+
     def handle_reconnection(self, conn, data, requestHeader):
         request = protocol.ConnectionRequest(requestHeader)
         response_success = protocol.ResponseEncryptedAES()
@@ -243,6 +418,10 @@ class Server:
             response_fail.header.code = protocol.EResponseCode.REQUEST_FOR_RECONNECTION_DENIED.value
             return self.write(conn, response_fail.pack())
 
+        # A client that registered by key agreement agrees on a new aes key
+        if this_client.has_agreement_key():
+            return self.send_agreed_key(conn, this_client)
+
         # Create an aes key and encrypt it to save
         aes_cipher = keys.AESCipher()
         encrypted_key = aes_cipher.encrypt_aes_with_rsa(this_client.public_key)
@@ -260,9 +439,55 @@ class Server:
         logging.info(f"Successfully reconnected and sending aes.")
         return self.write(conn, response_success.pack())
 
+    def send_session_ticket(self, conn, this_client):
+        """ Issue a ticket that resumes the client's current session, bound to its id. """
+        secret = keys.resumption_secret(self.client_aes_ciphers[this_client].key)
+        response = protocol.ResponseSessionTicket()
+        response.client_ID = this_client.id
+        response.lifetime = protocol.TICKET_LIFETIME
+        response.ticket = keys.seal_ticket(self.ticket_key, this_client.id, secret,
+                                           int(time.time()) + protocol.TICKET_LIFETIME)
+        response.header.payload_size = response.payload_size()
+        return self.write(conn, response.pack())
+
+    def handle_ticket_request(self, conn, data, request_header):
+        """ Issue a session ticket to a client that already has an aes key. """
+        this_client = next((client for client in self.client_list if client.id == request_header.client_id), None)
+        if not this_client or this_client not in self.client_aes_ciphers:
+            logging.error(f"Ticket Request: client ({request_header.client_id}) has no session to resume")
+            return False
+
+        logging.info(f"Issuing a session ticket.")
+        return self.send_session_ticket(conn, this_client)
+
+    def handle_resumption(self, conn, data, request_header):
+        """ Resume a session with its ticket, no asymmetric key operation is needed. """
+        request = protocol.ResumptionRequest(request_header)
+        response_fail = protocol.ResponseClientID()
+        response_fail.header.code = protocol.EResponseCode.REQUEST_FOR_RECONNECTION_DENIED.value
+
+        if not request.unpack(data):
+            logging.error("Resumption Request: Failed parsing request.")
+            return False
+
+        this_client = next((client for client in self.client_list if client.name == request.name), None)
+        if not this_client or this_client.id != request.header.client_id:
+            logging.error(f"Resumption Request: Invalid requested username ({request.name}) "
+                          f"or id ({request.header.client_id})")
+            return self.write(conn, response_fail.pack())
+
+        ticket = keys.open_ticket(self.ticket_key, request.ticket)
+        if not ticket or ticket[0] != this_client.id or ticket[2] <= time.time():
+            logging.warning(f"Resumption Request: invalid or expired ticket of client ({this_client.id})")
+            return self.write(conn, response_fail.pack())
+
+        # The resumed session's key is derived from the ticket's secret, and comes with its own ticket
+        self.client_aes_ciphers[this_client] = keys.AESCipher(keys.resumed_aes_key(ticket[1], request.nonce))
+        logging.info(f"Successfully resumed session.")
+        return self.send_session_ticket(conn, this_client)
+
     def handle_sending_file(self, conn, data, request_header):
         request = protocol.RequestSendingFile()
-        sub_response = protocol.ResponseMessage()
 
         # Handle sending file failure:
         if not request.unpack(data):
@@ -270,7 +495,7 @@ class Server:
             return False
 
         # Handle invalid packets
-        if request.packets.packet_number > request.packets.total_packets:
+        if not 1 <= request.packets.packet_number <= request.packets.total_packets:
             logging.error("Send File Request: on packet number 1: Packet number exceeded total packets.")
             return False
 
@@ -295,36 +520,157 @@ class Server:
                           f"does not have username or a public key")
             return False
 
-        # Store the current packet of the encrypted file into this client
-        this_client.file_content[request.file_name] += request.message_content
+        # A first packet starts the file over, dropping whatever a failed attempt left.
+        # A first packet resent after it was rejected doesn't, the packets that followed it are kept.
+        incoming = this_client.file_content.get(request.file_name)
+        if request.packets.packet_number == 1 and (not incoming or incoming.started or
+                                                   incoming.total_packets != request.packets.total_packets):
+            if incoming:
+                incoming.close()
+            incoming = client_model.IncomingFile(request.packets.total_packets, request.content_size)
+            this_client.file_content[request.file_name] = incoming
+        elif not incoming:
+            logging.error(f"Send File Request: on packet number {request.packets.packet_number}: "
+                          f"the file's first packet wasn't received")
+            return False
+        return self.receive_packet(conn, this_client, request, incoming)
+
+    def handle_open_transfer(self, conn, data, request_header):
+        """ Start receiving a file described once, its packets are sent with the transfer ID in the reply. """
+        request = protocol.OpenTransferRequest()
 
-        if request.packets.packet_number < request.packets.total_packets:
+        if not request.unpack(data):
+            logging.error("Open Transfer Request: Failed parsing request.")
+            return False
 
-            # Send successful sub file packet response
-            logging.info("Successfully received file packet message. Sending thank you reply.")
+        this_client = next((client for client in self.client_list if client.id == request.header.client_id), None)
+        if not this_client or not this_client.name or not this_client.public_key or \
+                this_client not in self.client_aes_ciphers:
+            logging.error(f"Open Transfer Request: Invalid requested id ({request.header.client_id}) "
+                          f"is not registered or does not have a public key")
+            return False
 
-            sub_response.client_ID = this_client.id
-            sub_response.header.payload_size = protocol.CLIENT_ID_SIZE
-            return self.write(conn,  sub_response.pack())
+        if request.packets.total_packets < 1:
+            logging.error("Open Transfer Request: a file has one packet at least.")
+            return False
+
+        if not protocol.PACKET_SIZE <= request.frame_size <= self.max_frame_size:
+            logging.error(f"Open Transfer Request: frames of {request.frame_size} bytes weren't agreed on.")
+            return False
+
+        # Opening a file starts it over, dropping whatever a failed attempt left
+        incoming = this_client.file_content.get(request.file_name)
+        if incoming:
+            incoming.close()
+        this_client.file_content[request.file_name] = \
+            client_model.IncomingFile(request.packets.total_packets, request.content_size)
+        this_client.forget_transfers(request.file_name)
+        if request.salt is not None:
+            request.content_key = keys.transfer_key(self.client_aes_ciphers[this_client].key, request.salt)
+        transfer_id = next(self.transfer_ids) & 0xFFFFFFFF
+        this_client.transfers[transfer_id] = request
+
+        response = protocol.ResponseTransferOpened()
+        response.client_ID = this_client.id
+        response.transfer_id = transfer_id
+        response.header.payload_size = response.payload_size()
+        logging.info(f"Opened transfer {transfer_id} of {request.file_name}.")
+        return self.write(conn, response.pack())
+
+    def handle_sending_file_data(self, conn, data, request_header):
+        """ A packet of an open transfer, handled as a packet of the file the transfer described. """
+        file_data = protocol.RequestSendingFileData(request_header)
+
+        if not file_data.unpack(data):
+            logging.error("Send File Data Request: Failed parsing request.")
+            return False
+
+        this_client = next((client for client in self.client_list if client.id == request_header.client_id), None)
+        transfer = this_client.transfers.get(file_data.transfer_id) if this_client else None
+        completed = this_client.completed.get(file_data.transfer_id) if this_client and not transfer else None
+        if not transfer and not completed:
+            logging.error(f"Send File Data Request: client ({request_header.client_id}) "
+                          f"has no open transfer {file_data.transfer_id}")
+            return False
+
+        request = (transfer or completed[0]).packet(file_data)
+        if not 1 <= request.packets.packet_number <= request.packets.total_packets:
+            logging.error(f"Send File Data Request: packet number {request.packets.packet_number} "
+                          f"exceeded total packets.")
+            return False
+
+        if completed:
+            # Sent again after the connection it was in flight over failed, the file is already received.
+            # The packet that completed it is answered with its CRC again, the others acknowledged.
+            _, completing_packet, reply = completed
+            logging.info(f"Send File Data Request: packet {request.packets.packet_number} of completed transfer "
+                         f"{file_data.transfer_id} was sent again, answering it as before.")
+            if request.packets.packet_number == completing_packet:
+                return self.write(conn, reply)
+            return self.acknowledge_packet(conn, this_client, request)
+
+        incoming = this_client.file_content.get(request.file_name)
+        if not incoming:
+            logging.error(f"Send File Data Request: transfer {file_data.transfer_id} was already completed")
+            return False
+        return self.receive_packet(conn, this_client, request, incoming, file_data.transfer_id)
+
+    def receive_packet(self, conn, this_client, request, incoming, transfer_id=None):
+        """ Spool a packet of the file, the one completing it is answered with the CRC of the decrypted file.
+        The reply completing a transfer is kept, to answer the packet again if it's resent. """
+        sealed = request.cipher_mode == protocol.ECipherMode.GCM
+        key = request.content_key or self.client_aes_ciphers[this_client].key
+        if sealed:
+            # Authenticate and decrypt a sealed packet on arrival, a bad one is rejected to be sent again
+            content = keys.open_sealed_packet(key, request.packets.packet_number, request.message_content)
+            if content is None:
+                logging.warning(f"Send File Request: packet {request.packets.packet_number} failed authentication,"
+                                f" rejecting it.")
+                reject = protocol.ResponsePacketRejected()
+                reject.client_ID = this_client.id
+                reject.packet_number = request.packets.packet_number
+                reject.header.payload_size = reject.payload_size()
+                return self.write(conn, reject.pack())
+            chunk_size = request.chunk_size - protocol.SEALED_OVERHEAD
+        else:
+            content = request.message_content
+            chunk_size = request.chunk_size
+
+        # Spool the current packet of the file at its offset, the file may be far larger than memory
+        incoming.write(request.packets.packet_number, chunk_size, content)
+
+        # Sealed packets may complete the file out of order, after a rejected one was sent again.
+        # So may the packets of a transfer striped over several connections.
+        striped = request.header.version >= protocol.STRIPED_VERSION
+        last_packet = incoming.is_complete() if sealed or striped else \
+            request.packets.packet_number == request.packets.total_packets
+        if not last_packet:
+            return self.acknowledge_packet(conn, this_client, request)
 
 
         # Handle the final chunk
-        response = protocol.ReceivedValidFileWithCRC()
+        response = protocol.ReceivedValidFileWithCRC(request.is_large())
 
-        # Decrypt message using our aes key that was saved for this client
-        key = self.client_aes_ciphers[this_client].key
-        decrypted_message = keys.decrypt_message(key, this_client.file_content[request.file_name])
+        expected_size = request.orig_file_size if sealed else request.content_size
+        if not incoming.is_complete() or incoming.size() != expected_size:
+            logging.error(f"Send File Request: received {incoming.size()} bytes of content "
+                          f"while expecting {expected_size}")
+            return False
 
-        if not decrypted_message:
+        # Decrypt message using our aes key that was saved for this client, checksumming it on the way.
+        # Sealed packets were decrypted as they arrived.
+        crc = cksum.Cksum()
+        if sealed:
+            decrypt = incoming.read_into
+        else:
+            decrypt = lambda write: keys.decrypt_file(key, incoming.spool, write, request.cipher_mode)
+        if not utils.write_decrypted_stream(request.file_name, decrypt, crc):
             logging.error(f"Send File Request: failed decrypting requested message content")
             return False  # Send a generic response in this case
 
         # Reset the file_content for this client, for future retries, to resend the file
-        this_client.file_content[request.file_name] = b""
-
-        # Write the valid file
-        if not utils.write_decrypted_file(request.file_name, decrypted_message):
-            return False
+        incoming.close()
+        this_client.file_content[request.file_name] = None
 
 
         # Handle a successful sending file with crc
@@ -338,14 +684,29 @@ class Server:
                                                                                b'\x00'))(request.file_name,
                                                                                          protocol.FILE_NAME_SIZE)
 
-        # Calculate crc from the valid file
-        response.crc = cksum.readfile(request.file_name)
-        response.header.payload_size = (protocol.CLIENT_ID_SIZE + protocol.CONTENT_SIZE +
-                                        protocol.FILE_NAME_SIZE + protocol.CRC_SIZE)
+        # The crc of the valid file, computed while it was written
+        response.crc = crc.digest()
+        response.header.payload_size = response.payload_size()
 
         logging.info("Successfully file transferred completely. Sending calculated CRC.")
+        if transfer_id is not None:
+            this_client.complete_transfer(transfer_id, request.packets.packet_number, response.pack())
         return self.write(conn, response.pack())
 
+    def acknowledge_packet(self, conn, this_client, request):
+        """ Send successful sub file packet response """
+        logging.info("Successfully received file packet message. Sending thank you reply.")
+
+        if request.header.version >= protocol.WINDOWED_ACK_VERSION:
+            sub_response = protocol.ResponsePacketReceived(request.is_large())
+            sub_response.packet_number = request.packets.packet_number
+            sub_response.header.payload_size = sub_response.payload_size()
+        else:
+            sub_response = protocol.ResponseMessage()
+            sub_response.header.payload_size = protocol.CLIENT_ID_SIZE
+        sub_response.client_ID = this_client.id
+        return self.write(conn,  sub_response.pack())
+
     def handle_message(self, conn, data, request_header):
         request = protocol.RequestMessage(request_header)
         response = protocol.ResponseMessage()
@@ -383,6 +744,9 @@ class Server:
                           f"didn't send file")
             return False
 
+        # The file's CRC is settled, its transfers won't be answered again
+        this_client.forget_transfers(request.file_name)
+
         # Send successful response
         logging.info("Successfully received crc message. Sending thank you reply.")
 
@@ -39,3 +39,15 @@ def write_decrypted_file(file_name, decrypted_message):
         logging.exception(f"Exception while writing to file {file_name}: {e}")
     return False
 
+
+def write_decrypted_stream(file_name, decrypt, crc):
+    """ Write the file as decrypt passes its plain text to the given writer, updating crc on the way """
+    try:
+        with open(file_name, 'wb') as f:
+            def write(block):
+                f.write(block)
+                crc.update(block)
+            return decrypt(write)
+    except Exception as e:
+        logging.exception(f"Exception while writing to file {file_name}: {e}")
+    return False